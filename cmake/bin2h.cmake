@@ -37,8 +37,43 @@ function(WRAP_STRING)
     set(${WRAP_STRING_VARIABLE} "${lines}" PARENT_SCOPE)
 endfunction()
 
+# Function to convert the contents of a file into a byte array definition VARIABLE_NAME_ARRAY and a
+# std::string_view VARIABLE_NAME onto it.
+# Parameters
+#   FILE            - The path of the file to convert.
+#   VARIABLE_NAME   - The name of the string_view, already a proper C identifier.
+#   RESULT          - The variable the definitions are written to.
+#   NULL_TERMINATE  - If specified a null byte(zero) will be append to the byte array, the string_view does not include it.
+function(FILE2ARRAY)
+    set(options NULL_TERMINATE)
+    set(oneValueArgs FILE VARIABLE_NAME RESULT)
+    cmake_parse_arguments(FILE2ARRAY "${options}" "${oneValueArgs}" "" ${ARGN})
+
+    # reads source file contents as hex string
+    file(READ ${FILE2ARRAY_FILE} hexString HEX)
+    string(LENGTH ${hexString} hexStringLength)
+
+    # appends null byte if asked
+    if(FILE2ARRAY_NULL_TERMINATE)
+        set(hexString "${hexString}00")
+    endif()
+
+    # wraps the hex string into multiple lines at column 32(i.e. 16 bytes per line)
+    wrap_string(VARIABLE hexString AT_COLUMN 32)
+    math(EXPR arraySize "${hexStringLength} / 2")
+
+    # adds '0x' prefix and comma suffix before and after every byte respectively
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1, " arrayValues ${hexString})
+    # removes trailing comma
+    string(REGEX REPLACE ", $" "" arrayValues ${arrayValues})
+
+    # declares byte array and the length variables
+    set(${FILE2ARRAY_RESULT} "constexpr char ${FILE2ARRAY_VARIABLE_NAME}_ARRAY[]{ ${arrayValues} };\nconstexpr std::string_view ${FILE2ARRAY_VARIABLE_NAME}{${FILE2ARRAY_VARIABLE_NAME}_ARRAY, ${arraySize}};\n" PARENT_SCOPE)
+endfunction()
+
 # Function to embed contents of a file as byte array in C/C++ header file(.h). The header file
-# will contain a byte array and integer variable holding the size of the array.
+# will contain a byte array and a string_view onto it, a gzip compressed variant (VARIABLE_NAME_GZIP,
+# empty if gzip is not available) and a web_asset VARIABLE_NAME_ASSET with both and a content hash (for http ETags).
 # Parameters
 #   SOURCE_FILE     - The path of source file whose contents will be embedded in the header file.
 #   VARIABLE_NAME   - The name of the variable for the byte array. The string "_SIZE" will be append
@@ -64,35 +99,36 @@ function(BIN2H)
         file(COPY_FILE ${BIN2H_SOURCE_FILE} ${minified_file})
     endif()
 
-    # reads source file contents as hex string
-    file(READ ${minified_file} hexString HEX)
-    string(LENGTH ${hexString} hexStringLength)
+    # converts the variable name into proper C identifier
+    string(MAKE_C_IDENTIFIER "${BIN2H_VARIABLE_NAME}" BIN2H_VARIABLE_NAME)
+    string(TOUPPER "${BIN2H_VARIABLE_NAME}" BIN2H_VARIABLE_NAME)
 
-    # appends null byte if asked
     if(BIN2H_NULL_TERMINATE)
-        set(hexString "${hexString}00")
+        set(nullTerminate NULL_TERMINATE)
     endif()
+    file2array(FILE ${minified_file} VARIABLE_NAME ${BIN2H_VARIABLE_NAME} RESULT arrayDefinition ${nullTerminate})
 
-    # wraps the hex string into multiple lines at column 32(i.e. 16 bytes per line)
-    wrap_string(VARIABLE hexString AT_COLUMN 32)
-    math(EXPR arraySize "${hexStringLength} / 2")
-
-    # adds '0x' prefix and comma suffix before and after every byte respectively
-    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1, " arrayValues ${hexString})
-    # removes trailing comma
-    string(REGEX REPLACE ", $" "" arrayValues ${arrayValues})
-
-    # converts the variable name into proper C identifier
-    string(MAKE_C_IDENTIFIER "${BIN2H_VARIABLE_NAME}" BIN2H_VARIABLE_NAME)
-    string(TOUPPER "${BIN2H_VARIABLE_NAME}" BIN2H_VARIABLE_NAME)
+    # precompressed variant, -n keeps the output reproducible
+    set(gzip_file "${BIN2H_HEADER_FILE}.gz.tmp")
+    execute_process(COMMAND gzip -9 -n -c ${minified_file} OUTPUT_FILE ${gzip_file} RESULT_VARIABLE res)
+    if (res EQUAL 0)
+        file2array(FILE ${gzip_file} VARIABLE_NAME ${BIN2H_VARIABLE_NAME}_GZIP RESULT gzipDefinition)
+    else()
+        message("Failed to gzip ${BIN2H_SOURCE_FILE}, it is only served uncompressed")
+        set(gzipDefinition "constexpr std::string_view ${BIN2H_VARIABLE_NAME}_GZIP{};\n")
+    endif()
 
-    # declares byte array and the length variables
-    set(arrayDefinition "constexpr char ${BIN2H_VARIABLE_NAME}_ARRAY[]{ ${arrayValues} };")
+    file(MD5 ${minified_file} contentHash)
+    string(SUBSTRING ${contentHash} 0 16 contentHash)
+    set(assetDefinition "constexpr web_asset ${BIN2H_VARIABLE_NAME}_ASSET{${BIN2H_VARIABLE_NAME}, ${BIN2H_VARIABLE_NAME}_GZIP, \"${contentHash}\"};\n")
 
     if(BIN2H_APPEND)
-        file(APPEND ${BIN2H_HEADER_FILE} "${arrayDefinition}\nconstexpr std::string_view ${BIN2H_VARIABLE_NAME}{${BIN2H_VARIABLE_NAME}_ARRAY, ${arraySize}};\n")
+        file(APPEND ${BIN2H_HEADER_FILE} "${arrayDefinition}${gzipDefinition}${assetDefinition}")
     else()
-        file(WRITE ${BIN2H_HEADER_FILE} "#include <string_view>\n${arrayDefinition}\nconstexpr std::string_view ${BIN2H_VARIABLE_NAME}{${BIN2H_VARIABLE_NAME}_ARRAY, ${arraySize}};\n")
+        file(WRITE ${BIN2H_HEADER_FILE} "#include <string_view>\n"
+            "/** @brief embedded file with its gzip variant (empty if not available) and a hash of the content */\n"
+            "struct web_asset {\n\tstd::string_view data;\n\tstd::string_view gzip;\n\tstd::string_view hash;\n};\n"
+            "${arrayDefinition}${gzipDefinition}${assetDefinition}")
     endif()
 endfunction()
 
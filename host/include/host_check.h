@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdio>
+
+#include "host_firmware.h"
+
+/** @brief number of failed checks, the tests return it from main so ctest reports them */
+inline int host_check_failures{};
+
+/** @brief prints the failed condition with its location and continues with the test */
+#define HOST_CHECK(cond) do { \
+		if (!(cond)) { \
+			++host_check_failures; \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+/** @brief boots the firmware storage on erased flash like a fresh device, returns the firmware for its tasks */
+inline host_firmware& host_check_boot(int argc, char **argv) {
+	static host_options opts{argc, argv};
+	static host_firmware firmware{};
+	host_sim::Default().now_us = 1000000;
+	firmware.boot(opts, 1767225600);
+	return firmware;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+#include "hardware/watchdog.h"
+#include "kraftfutterstation.h"
+#include "host_sim.h"
+
+/**
+ * @brief Boots the firmware parts of the station bus like startup_task() in main.cpp and runs their tasks in the simulation.
+ * The timing and feed settings can be overridden from the command line with the names used by the usb set commands,
+ * the flash times with --flash_erase_us (per sector) and --flash_program_us (per page).
+ */
+struct host_firmware {
+	host_task storage_task{};
+	// cpu time spent in handle_station_communication(), the only value of a run depending on the host
+	uint64_t step_count{};
+	uint64_t step_ns_sum{};
+	uint64_t step_ns_max{};
+
+	void boot(const host_options &opts, time_t epoch) {
+		auto &sim = host_sim::Default();
+		sim.flash_sector_erase_us = opts.get("flash_erase_us", double(sim.flash_sector_erase_us));
+		sim.flash_page_program_us = opts.get("flash_program_us", double(sim.flash_page_program_us));
+		ntp_client::Default().set_time_since_epoch(epoch);
+		kuhspeicher::Default().migrate_storage();
+		kuhspeicher::Default().sanitize_cows();
+		auto &storage = persistent_storage_t::Default();
+		storage.read(&persistent_storage_layout::setting, settings::Default());
+		settings &s = settings::Default();
+		s.dispense_timeout = opts.get("dispense_timeout", s.dispense_timeout);
+		s.rations = opts.get("rations", s.rations);
+		s.reset_times = opts.get("reset_times", s.reset_times);
+		s.sanitize();
+		storage.write(s, &persistent_storage_layout::setting);
+		load_station_timing();
+		station_timing &t = station_timing::Default();
+		t.pipelined = opts.get("pipelined", t.pipelined);
+		t.frame_gap_us = opts.get("frame_gap_us", t.frame_gap_us);
+		t.feeds_per_slot = opts.get("feeds_per_slot", t.feeds_per_slot);
+		t.hw_timer = opts.get("hw_timer", t.hw_timer);
+		for (int f = 0; f < station_timing::COUNT; ++f)
+			t.frame_timeouts_us[f] = opts.get(std::array{"timeout_p0_us", "timeout_p1_us", "timeout_p2_us", "timeout_feed_us", "timeout_p3_us"}[f], t.frame_timeouts_us[f]);
+		t.sanitize();
+		store_station_timing();
+		kuhspeicher::Default().reload_last_feeds();
+		rations_in_flight<>::Default().load();
+		storage_task.step = [] {
+			persistent_storage_t::Default().maintain();
+			return 100;
+		};
+		storage_task.start();
+	}
+	/** @brief the task loop of kraftfutter_send_task() in main.cpp */
+	template<typename bus>
+	void start_bus(host_task &task) {
+		bus::Default().started = true;
+		task.step = [this] {
+			watchdog_update();
+			auto start = std::chrono::steady_clock::now();
+			int delay = bus::Default().handle_station_communication();
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			++step_count;
+			step_ns_sum += ns;
+			step_ns_max = std::max(step_ns_max, ns);
+			return delay;
+		};
+		task.start();
+	}
+	/** @brief adds a cow, the kraftfutter is given in kg per day */
+	static void add_cow(int halsband, float kg, std::string_view name = {}) {
+		kuh k{};
+		if (name.empty())
+			k.name.fill_formatted("cow{}", halsband);
+		else
+			k.name.fill(name);
+		k.halsbandnr = halsband;
+		k.kraftfuttermenge = kg;
+		kuhspeicher::Default().write_or_create_cow(k);
+	}
+
+	/** @brief prints the counters of the firmware and the simulation shared by all host tools */
+	template<typename bus, typename uart_t>
+	void print_report(uint64_t duration_us) const {
+		const auto &m = measurements::Default();
+		station_bus_stats total{};
+		for (const auto &b: bus::Default().bus_stats) {
+			total.good_frames += b.good_frames;
+			total.framing_errors += b.framing_errors;
+			total.timeouts += b.timeouts;
+			total.late_answers += b.late_answers;
+		}
+		const auto &uart = host_sim::Default().uarts[uart_t::Default().uart->index];
+		std::printf("answers: good %u, framing errors %u, timeouts %u, late %u\n", total.good_frames, total.framing_errors, total.timeouts, total.late_answers);
+		std::printf("rations dispensed %u (%.1f per hour)\n", m.rations_dispensed, m.rations_dispensed * 3600e6 / std::max<uint64_t>(duration_us, 1));
+		std::printf("firmware arrival to ration max %u ms, ration wait max %u ms\n", m.arrival_to_ration_max_ms, m.ration_wait_max_ms);
+		std::printf("high water: rations in flight %d (full %u times)\n", m.rations_in_flight_max, m.rations_in_flight_full);
+		std::printf("rx overruns: uart %u, rx buffer %u\n", uart.rx_overruns, uart_t::Default().rx_overruns);
+		std::printf("watchdog: longest time without update %.1f ms\n", host_sim::Default().watchdog_max_gap_us / 1000.);
+		const auto &fs = persistent_storage_t::Default().stats;
+		std::printf("flash: %u sectors erased, %u bytes programmed\n", fs.sectors_erased, fs.bytes_programmed);
+		const auto &sim = host_sim::Default();
+		std::printf("stalls by flash: %.1f ms in total, longest %.1f ms\n", sim.stall_us_sum / 1000., sim.stall_max_us / 1000.);
+		std::printf("locks: longest hold %.1f ms, %u contended takes\n", sim.lock_hold_max_us / 1000., sim.lock_contentions);
+		std::printf("cpu per step: mean %.0f ns, max %llu ns (host dependent)\n", step_count ? double(step_ns_sum) / step_count: 0., (unsigned long long)step_ns_max);
+	}
+};
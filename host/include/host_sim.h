@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using irq_handler_t = void (*)();
+
+/**
+ * @brief Uart as seen by the firmware, bytes are moved in simulated time.
+ * Without fifo (as configured by uart_connection) the transmitter holds one byte in the shift register and one
+ * in the holding register, so it is writable as long as at most one byte is still being sent.
+ * The receiver holds a single byte, a byte arriving while the previous one was not read counts as overrun.
+ * Bytes arrive on hardware timers (see receive_at()), so they keep coming while a flash operation stalls the cpu.
+ */
+struct host_uart {
+	int index{};
+	uint32_t char_time_us{1000};
+	irq_handler_t handler{};
+	bool rx_irq{};
+	bool tx_irq{};
+	bool in_irq{};
+	bool tx_irq_scheduled{};
+	uint64_t tx_busy_until{}; // end of the last byte handed to the uart
+	std::vector<char> rx_holding{};
+	uint32_t rx_overruns{};
+	// called for every byte handed to the uart with the time its transmission starts
+	std::function<void(uint64_t start, char data)> on_tx{};
+	// called after every run of the interrupt handler, e.g. to follow the rx buffer of the firmware
+	std::function<void()> after_irq{};
+
+	bool writable() const;
+	bool readable() const { return !rx_holding.empty(); }
+	void put(char c);
+	char read();
+	/** @brief the byte arrives completely at the current simulated time */
+	void receive(char c);
+	/** @brief the byte arrives completely at time, also if the cpu is stalled then */
+	void receive_at(uint64_t time, char c);
+	void set_irq_enables(bool rx, bool tx);
+	/*INTERNAL*/ void _irq();
+	/*INTERNAL*/ void _schedule_tx_irq();
+};
+
+/**
+ * @brief Task of the simulation, step is one pass of the task loop and returns the ticks (ms) to wait,
+ * the wait ends early on a notification like ulTaskNotifyTake(pdTRUE, ticks) on the device.
+ */
+struct host_task {
+	std::function<int()> step{};
+	uint32_t notified{};
+	bool waiting{};
+	uint64_t generation{}; // invalidates the pending wake up timer
+
+	void start();
+	void notify();
+	/*INTERNAL*/ void _run();
+	/*INTERNAL*/ void _schedule(uint64_t time);
+};
+
+/** @brief thrown by the flash operation a power cut was armed for, see host_sim::flash_ops_until_power_cut */
+struct host_power_cut {};
+
+struct host_timer {
+	std::function<void()> f{};
+	bool hardware{}; // runs while the cpu is stalled, see host_sim::stall()
+};
+
+/**
+ * @brief Single threaded simulation of the pico on a host.
+ * Time only advances by running timers: interrupts, alarms and tasks are all called from timers at their
+ * simulated time, so a run with the same input is always the same.
+ * Flash operations stall both cores with interrupts disabled like flash_safe_execute() on the device,
+ * only hardware timers (bytes arriving at the uarts) run in time, everything else runs late after the stall.
+ */
+struct host_sim {
+	uint64_t now_us{};
+	std::multimap<uint64_t, host_timer> timers{}; // equal times run in the order they were added
+	std::array<host_uart, 2> uarts{host_uart{.index = 0}, host_uart{.index = 1}};
+	host_task *current_task{};
+	int32_t next_alarm_id{1};
+	std::set<int32_t> cancelled_alarms{};
+	uint64_t watchdog_last_us{};
+	uint64_t watchdog_max_gap_us{};
+	// typical times of the W25Q16JV on the pico boards, sector erase 45 ms, page program 0.4 ms
+	uint64_t flash_sector_erase_us{45000};
+	uint64_t flash_page_program_us{400};
+	int64_t flash_ops_until_power_cut{-1}; // if >= 0 the power is cut instead of running the flash operation after this many ones
+	uint64_t irqs_blocked_until{};
+	uint64_t stall_us_sum{};
+	uint64_t stall_max_us{};
+	uint64_t lock_hold_max_us{}; // longest time a semaphore was held
+	uint32_t lock_contentions{}; // takes of a semaphore held by another task, these block on the device
+
+	static host_sim& Default() {
+		static host_sim sim{};
+		return sim;
+	}
+
+	void at(uint64_t time, std::function<void()> f, bool hardware = false) {
+		timers.emplace(std::max(time, now_us), host_timer{.f = std::move(f), .hardware = hardware});
+	}
+	bool stalled() const { return now_us < irqs_blocked_until; }
+	/** @brief runs all timers due up to time and sets the clock to time, timers delayed by a stall run late */
+	void run_until(uint64_t time) {
+		while (!timers.empty() && timers.begin()->first <= time) {
+			auto it = timers.begin();
+			now_us = std::max(now_us, it->first);
+			std::function<void()> f = std::move(it->second.f);
+			timers.erase(it);
+			f();
+		}
+		now_us = std::max(now_us, time);
+	}
+	/** @brief called before every flash erase or program, the operation takes us */
+	void flash_operation(uint64_t us) {
+		if (flash_ops_until_power_cut == 0) {
+			flash_ops_until_power_cut = -1;
+			throw host_power_cut{};
+		}
+		if (flash_ops_until_power_cut > 0)
+			--flash_ops_until_power_cut;
+		stall(us);
+	}
+	/** @brief the cpu is blocked for us with interrupts disabled, only hardware timers run meanwhile */
+	void stall(uint64_t us) {
+		const uint64_t end = now_us + us;
+		irqs_blocked_until = std::max(irqs_blocked_until, end);
+		stall_us_sum += us;
+		stall_max_us = std::max(stall_max_us, us);
+		for (;;) {
+			auto it = std::find_if(timers.begin(), timers.upper_bound(end), [](const auto &t) { return t.second.hardware; });
+			if (it == timers.upper_bound(end))
+				break;
+			now_us = std::max(now_us, it->first);
+			std::function<void()> f = std::move(it->second.f);
+			timers.erase(it);
+			f();
+		}
+		now_us = end;
+	}
+	/** @brief blocking wait of the current task, the other tasks and interrupts keep running */
+	void delay(uint64_t us) {
+		host_task *task = current_task;
+		run_until(now_us + us);
+		current_task = task;
+	}
+	void feed_watchdog() {
+		if (watchdog_last_us)
+			watchdog_max_gap_us = std::max(watchdog_max_gap_us, now_us - watchdog_last_us);
+		watchdog_last_us = now_us;
+	}
+};
+
+inline bool host_uart::writable() const { return tx_busy_until <= host_sim::Default().now_us + char_time_us; }
+inline void host_uart::put(char c) {
+	const uint64_t start = std::max(host_sim::Default().now_us, tx_busy_until);
+	tx_busy_until = start + char_time_us;
+	if (on_tx)
+		on_tx(start, c);
+}
+inline char host_uart::read() {
+	if (rx_holding.empty())
+		return 0;
+	char c = rx_holding.front();
+	rx_holding.clear();
+	return c;
+}
+inline void host_uart::receive(char c) {
+	if (!rx_holding.empty())
+		++rx_overruns;
+	rx_holding = {c};
+	if (!rx_irq)
+		return;
+	auto &sim = host_sim::Default();
+	if (!sim.stalled()) {
+		_irq();
+		return;
+	}
+	// raised once the interrupts are enabled again
+	sim.at(sim.irqs_blocked_until, [this] {
+		if (rx_irq && readable())
+			_irq();
+	});
+}
+inline void host_uart::receive_at(uint64_t time, char c) { host_sim::Default().at(time, [this, c] { receive(c); }, true); }
+inline void host_uart::set_irq_enables(bool rx, bool tx) {
+	const bool tx_enabled = tx && !tx_irq;
+	rx_irq = rx;
+	tx_irq = tx;
+	if (!tx_enabled)
+		return;
+	// the pl011 raises the tx interrupt right away if it can take a byte
+	if (writable())
+		_irq();
+	else
+		_schedule_tx_irq();
+}
+inline void host_uart::_irq() {
+	if (in_irq || !handler)
+		return;
+	in_irq = true;
+	handler();
+	in_irq = false;
+	if (after_irq)
+		after_irq();
+	if (tx_irq)
+		_schedule_tx_irq();
+}
+inline void host_uart::_schedule_tx_irq() {
+	if (tx_irq_scheduled)
+		return;
+	tx_irq_scheduled = true;
+	host_sim::Default().at(tx_busy_until - char_time_us, [this] {
+		tx_irq_scheduled = false;
+		if (tx_irq && writable())
+			_irq();
+	});
+}
+
+inline void host_task::start() { _schedule(host_sim::Default().now_us); }
+inline void host_task::notify() {
+	++notified;
+	if (!waiting)
+		return;
+	waiting = false;
+	notified = 0;
+	_schedule(host_sim::Default().now_us);
+}
+inline void host_task::_run() {
+	auto &sim = host_sim::Default();
+	sim.current_task = this;
+	int ticks = step();
+	sim.current_task = nullptr;
+	if (ticks && !notified) {
+		waiting = true;
+		_schedule(sim.now_us + uint64_t(ticks) * 1000);
+		return;
+	}
+	if (ticks)
+		notified = 0;
+	_schedule(sim.now_us);
+}
+inline void host_task::_schedule(uint64_t time) {
+	uint64_t gen = ++generation;
+	host_sim::Default().at(time, [this, gen] {
+		if (gen != generation)
+			return;
+		waiting = false;
+		_run();
+	});
+}
+
+/** @brief command line options of the host tools given as --name value pairs, unnamed arguments are kept in order */
+struct host_options {
+	std::map<std::string, std::string, std::less<>> values{};
+	std::vector<std::string> args{};
+
+	host_options(int argc, char **argv) {
+		for (int i = 1; i < argc; ++i) {
+			std::string_view a{argv[i]};
+			if (a.starts_with("--") && i + 1 < argc)
+				values[std::string(a.substr(2))] = argv[++i];
+			else
+				args.emplace_back(a);
+		}
+	}
+	double get(std::string_view name, double def) const {
+		auto it = values.find(name);
+		return it == values.end() ? def: std::strtod(it->second.c_str(), nullptr);
+	}
+	std::string get(std::string_view name, std::string_view def) const {
+		auto it = values.find(name);
+		return it == values.end() ? std::string(def): it->second;
+	}
+};
+
+/** @brief collects the values of a measurement for a summary */
+struct host_samples {
+	std::vector<double> values{};
+
+	void add(double v) { values.push_back(v); }
+	/** @brief prints count, min, mean, 95th percentile and max */
+	void print(const char *name, const char *unit) const {
+		if (values.empty()) {
+			std::printf("%s: none\n", name);
+			return;
+		}
+		std::vector<double> v{values};
+		std::sort(v.begin(), v.end());
+		std::printf("%s: %zu, min %.1f %s, mean %.1f %s, p95 %.1f %s, max %.1f %s\n", name, v.size(), v.front(), unit,
+			std::accumulate(v.begin(), v.end(), 0.) / v.size(), unit, v[(v.size() - 1) * 95 / 100], unit, v.back(), unit);
+	}
+};
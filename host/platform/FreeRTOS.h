@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffu
+#define pdMS_TO_TICKS(ms) (ms) // 1 kHz tick like configured in FreeRTOSConfig.h
+#define portYIELD_FROM_ISR(woken) (void)(woken)
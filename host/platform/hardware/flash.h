@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+
+#include "pico/stdlib.h"
+
+#define FLASH_SECTOR_SIZE 4096u
+#define FLASH_PAGE_SIZE 256u
+
+inline void flash_range_erase(uint32_t offset, size_t count) {
+	if (offset % FLASH_SECTOR_SIZE || count % FLASH_SECTOR_SIZE || offset + count > PICO_FLASH_SIZE_BYTES) {
+		std::fprintf(stderr, "flash_range_erase(): unaligned or out of range\n");
+		std::abort();
+	}
+	host_sim::Default().flash_operation(count / FLASH_SECTOR_SIZE * host_sim::Default().flash_sector_erase_us);
+	std::memset(host_flash + offset, 0xff, count);
+}
+/** @brief programming can only clear bits like on the device */
+inline void flash_range_program(uint32_t offset, const uint8_t *data, size_t count) {
+	if (offset % FLASH_PAGE_SIZE || count % FLASH_PAGE_SIZE || offset + count > PICO_FLASH_SIZE_BYTES) {
+		std::fprintf(stderr, "flash_range_program(): unaligned or out of range\n");
+		std::abort();
+	}
+	host_sim::Default().flash_operation(count / FLASH_PAGE_SIZE * host_sim::Default().flash_page_program_us);
+	for (size_t i = 0; i < count; ++i)
+		host_flash[offset + i] &= data[i];
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#define UART0_IRQ 20
+#define UART1_IRQ 21
+#define PICO_DEFAULT_IRQ_PRIORITY 0x80
+
+inline void irq_set_exclusive_handler(unsigned num, irq_handler_t handler) {
+	if (num == UART0_IRQ || num == UART1_IRQ)
+		host_sim::Default().uarts[num - UART0_IRQ].handler = handler;
+}
+inline void irq_set_enabled(unsigned, bool) {}
+inline void irq_set_priority(unsigned, uint8_t) {}
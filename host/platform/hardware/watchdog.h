@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+/** @brief records the longest time between two updates, the device resets if it exceeds the watchdog timeout */
+inline void watchdog_update() { host_sim::Default().feed_watchdog(); }
+inline void watchdog_enable(uint32_t, bool) {}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "lwip/udp.h"
+
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *arg);
+inline int dns_gethostbyname(const char*, ip_addr_t*, dns_found_callback, void*) { return -1; }
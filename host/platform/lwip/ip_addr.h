@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+struct ip_addr_t { uint32_t addr; };
+inline bool ip_addr_cmp(const ip_addr_t *a, const ip_addr_t *b) { return a->addr == b->addr; }
+inline const char* ipaddr_ntoa(const ip_addr_t*) { return "0.0.0.0"; }
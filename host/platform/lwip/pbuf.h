@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// no network on the host, only what ntp_client needs to compile
+typedef uint16_t u16_t;
+enum pbuf_layer { PBUF_TRANSPORT };
+enum pbuf_type { PBUF_RAM };
+struct pbuf {
+	void *payload;
+	u16_t tot_len;
+};
+inline pbuf* pbuf_alloc(pbuf_layer, u16_t, pbuf_type) { return nullptr; }
+inline uint8_t pbuf_free(pbuf*) { return 0; }
+inline uint8_t pbuf_get_at(const pbuf*, u16_t) { return 0; }
+inline u16_t pbuf_copy_partial(const pbuf*, void*, u16_t, u16_t) { return 0; }
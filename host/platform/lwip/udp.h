@@ -0,0 +1,12 @@
+#pragma once
+
+#include "lwip/pbuf.h"
+#include "lwip/ip_addr.h"
+
+#define ERR_OK 0
+#define IPADDR_TYPE_ANY 46
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, udp_pcb *pcb, pbuf *p, const ip_addr_t *addr, u16_t port);
+inline udp_pcb* udp_new_ip_type(uint8_t) { return nullptr; }
+inline void udp_recv(udp_pcb*, udp_recv_fn, void*) {}
+inline int udp_sendto(udp_pcb*, pbuf*, const ip_addr_t*, u16_t) { return -1; }
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+inline int flash_safe_execute(void (*func)(void*), void *param, uint32_t) {
+	func(param);
+	return PICO_OK;
+}
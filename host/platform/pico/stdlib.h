@@ -0,0 +1,79 @@
+#pragma once
+
+// Host replacement of the pico sdk parts used by the station bus firmware, backed by host_sim
+
+#include <cstdint>
+#include <cstring>
+
+#include "host_sim.h"
+
+typedef int err_t;
+#define PICO_OK 0
+#define PICO_ERROR_GENERIC -1
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+extern "C" char host_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE (uintptr_t(host_flash))
+#define __not_in_flash_func(f) f
+#define __no_inline_not_in_flash_func(f) f
+#define __isr
+#define __uninitialized_ram(group) group
+
+// time
+typedef uint64_t absolute_time_t;
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+inline uint64_t time_us_64() { return host_sim::Default().now_us; }
+inline absolute_time_t get_absolute_time() { return time_us_64(); }
+inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+inline uint32_t to_ms_since_boot(absolute_time_t t) { return uint32_t(t / 1000); }
+inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + uint64_t(ms) * 1000; }
+inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return int64_t(to - from); }
+inline bool time_reached(absolute_time_t t) { return time_us_64() >= t; }
+inline void sleep_ms(uint32_t ms) { host_sim::Default().delay(uint64_t(ms) * 1000); }
+inline alarm_id_t add_alarm_at(absolute_time_t t, alarm_callback_t cb, void *user_data, bool fire_if_past) {
+	auto &sim = host_sim::Default();
+	if (t < sim.now_us && !fire_if_past)
+		return 0;
+	alarm_id_t id = sim.next_alarm_id++;
+	sim.at(t, [id, cb, user_data] {
+		if (!host_sim::Default().cancelled_alarms.erase(id))
+			cb(id, user_data);
+	});
+	return id;
+}
+inline alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t cb, void *user_data, bool fire_if_past) {
+	return add_alarm_at(make_timeout_time_ms(ms), cb, user_data, fire_if_past);
+}
+inline bool cancel_alarm(alarm_id_t id) { return host_sim::Default().cancelled_alarms.insert(id).second; }
+
+// uart
+struct uart_inst_t { int index; };
+inline uart_inst_t host_uart_inst[2]{{0}, {1}};
+#define uart0 (&host_uart_inst[0])
+#define uart1 (&host_uart_inst[1])
+enum uart_parity_t { UART_PARITY_NONE, UART_PARITY_EVEN, UART_PARITY_ODD };
+#define GPIO_FUNC_UART 2
+#define UART_FUNCSEL_NUM(uart, gpio) GPIO_FUNC_UART
+/** @brief the data register reads the recieved byte like on the device */
+struct uart_hw_t {
+	struct data_register {
+		int index;
+		operator uint32_t() const { return uint8_t(host_sim::Default().uarts[index].read()); }
+	} dr;
+};
+inline uart_hw_t host_uart_hw[2]{{{0}}, {{1}}};
+inline uint32_t host_uart_baud[2]{};
+inline int uart_get_index(uart_inst_t *uart) { return uart->index; }
+inline uart_hw_t* uart_get_hw(uart_inst_t *uart) { return &host_uart_hw[uart->index]; }
+inline unsigned uart_init(uart_inst_t *uart, unsigned baud) { return host_uart_baud[uart->index] = baud; }
+inline void uart_set_format(uart_inst_t *uart, unsigned data_bits, unsigned stop_bits, uart_parity_t parity) {
+	uint32_t bits = 1 + data_bits + (parity != UART_PARITY_NONE) + stop_bits;
+	host_sim::Default().uarts[uart->index].char_time_us = bits * 1000000 / host_uart_baud[uart->index];
+}
+inline void gpio_set_function(unsigned, int) {}
+inline void uart_set_fifo_enabled(uart_inst_t*, bool) {}
+inline void uart_set_irq_enables(uart_inst_t *uart, bool rx, bool tx) { host_sim::Default().uarts[uart->index].set_irq_enables(rx, tx); }
+inline bool uart_is_writable(uart_inst_t *uart) { return host_sim::Default().uarts[uart->index].writable(); }
+inline bool uart_is_readable(uart_inst_t *uart) { return host_sim::Default().uarts[uart->index].readable(); }
+inline void uart_putc_raw(uart_inst_t *uart, char c) { host_sim::Default().uarts[uart->index].put(c); }
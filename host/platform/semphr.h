@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "FreeRTOS.h"
+#include "host_sim.h"
+
+/**
+ * @brief Binary semaphore of the simulation, only used by mutex.h.
+ * A task can not block in the single threaded simulation, so a take of a taken semaphore is checked instead:
+ * by the same task (or both outside of tasks) it deadlocks on the device and aborts the simulation,
+ * by another task (the holder waits in vTaskDelay() below on the stack) it is counted as contention.
+ */
+struct host_semaphore {
+	bool available{};
+	host_task *holder{};
+	uint64_t taken_at{};
+};
+typedef host_semaphore* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return new host_semaphore{}; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+	auto &sim = host_sim::Default();
+	if (s->available)
+		return pdFALSE;
+	if (s->taken_at)
+		sim.lock_hold_max_us = std::max(sim.lock_hold_max_us, sim.now_us - s->taken_at);
+	s->available = true;
+	s->taken_at = 0;
+	return pdTRUE;
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t) {
+	auto &sim = host_sim::Default();
+	if (!s->available && s->holder == sim.current_task) {
+		std::fprintf(stderr, "Semaphore taken again by its holder at %.3f s, this deadlocks on the device\n", sim.now_us / 1e6);
+		std::abort();
+	}
+	if (!s->available)
+		++sim.lock_contentions;
+	s->available = false;
+	s->holder = sim.current_task;
+	s->taken_at = sim.now_us;
+	return pdTRUE;
+}
+inline void vSemaphoreDelete(SemaphoreHandle_t s) { delete s; }
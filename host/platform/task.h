@@ -0,0 +1,19 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include "host_sim.h"
+
+typedef host_task* TaskHandle_t;
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return host_sim::Default().current_task; }
+inline void vTaskDelay(TickType_t ticks) { host_sim::Default().delay(uint64_t(ticks) * 1000); }
+inline void xTaskNotifyGive(TaskHandle_t task) {
+	if (task)
+		task->notify();
+}
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *) { xTaskNotifyGive(task); }
+inline BaseType_t xTaskNotifyStateClear(TaskHandle_t task) {
+	if (task)
+		task->notified = 0;
+	return pdTRUE;
+}
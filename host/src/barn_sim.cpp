@@ -0,0 +1,236 @@
+/**
+ * Virtual barn: a herd of cows visits the stations of one bus driven by the firmware in simulated time.
+ * Every cow comes back after an exponentially distributed time, if all stations are taken she waits for the
+ * next free one and stays a uniformly distributed time. The stations answer the requests of the firmware
+ * on the simulated uart like the real ones, so handle_station_communication() and kuhspeicher::feed_cow()
+ * run unchanged. The template parameters of the bus are set per executable, see add_barn_sim() in CMakeLists.txt.
+ *
+ * usage: barn_sim [--cows 60] [--kg 4] [--kg_spread 2] [--visit_interval_min 120] [--stay_min_s 60] [--stay_max_s 600]
+ *                 [--answer_delay_us 500] [--drop_rate 0] [--hours 24] [--seed 1] [settings, see host_firmware::boot()]
+ */
+
+#include <deque>
+#include <map>
+#include <random>
+
+#include "host_firmware.h"
+
+#ifndef SIM_STATIONS
+#define SIM_STATIONS 4
+#endif
+#ifndef SIM_RATIONS_PER_KG
+#define SIM_RATIONS_PER_KG 10
+#endif
+#ifndef SIM_REC_BUFFER_SIZE
+#define SIM_REC_BUFFER_SIZE 32
+#endif
+
+using bus_uart = uart_futterstationen;
+using bus = kraftfutterstation<bus_uart, SIM_STATIONS, 0, SIM_RATIONS_PER_KG, SIM_REC_BUFFER_SIZE>;
+using messages = bus::messages;
+
+static bool is_request(std::string_view f, std::string_view request) { return f.size() == request.size() && f.substr(1) == request.substr(1); }
+
+struct sim_cow {
+	int halsband{};
+	int station{-1};
+	uint64_t arrival{}; // time the cow entered the station
+	uint64_t queued_at{}; // time the cow started waiting for a free station
+	int visit_rations{};
+};
+
+/** @brief the herd and the stations answering the firmware, collects what the cows experienced */
+struct barn {
+	const host_options &opts;
+	std::mt19937_64 rng;
+	std::vector<sim_cow> cows{};
+	std::array<int, bus::stations> station_cow{}; // index into cows + 1, 0 if empty
+	std::deque<int> queue{}; // cows waiting for a free station
+	uint32_t char_time_us{bus_uart::CHAR_TIME_US};
+	double visit_interval_us{};
+	uint64_t stay_min_us{}, stay_max_us{}, answer_delay_us{};
+	double drop_rate{};
+	// results
+	int visits{}, visits_without_ration{}, rations{}, rations_to_empty_station{}, dropped_answers{};
+	size_t queue_max{};
+	uint32_t rx_buffer_max{};
+	host_samples queue_wait{}, arrival_to_first_ration{}, rations_per_visit{};
+
+	barn(const host_options &o): opts{o}, rng{uint64_t(o.get("seed", 1.))} {
+		visit_interval_us = opts.get("visit_interval_min", 120.) * 60e6;
+		stay_min_us = opts.get("stay_min_s", 60.) * 1e6;
+		stay_max_us = std::max<uint64_t>(stay_min_us, opts.get("stay_max_s", 600.) * 1e6);
+		answer_delay_us = opts.get("answer_delay_us", 500.);
+		drop_rate = opts.get("drop_rate", 0.);
+	}
+
+	void add_herd() {
+		const int count = std::clamp(int(opts.get("cows", 60.)), 1, std::min(MAX_COWS, 999));
+		const double kg = opts.get("kg", 4.), spread = opts.get("kg_spread", 2.);
+		std::uniform_real_distribution<double> kg_dist{std::max(kg - spread / 2, .5), kg + spread / 2};
+		for (int i = 0; i < count; ++i) {
+			cows.push_back(sim_cow{.halsband = i + 1});
+			host_firmware::add_cow(i + 1, kg_dist(rng));
+		}
+	}
+	void start() {
+		for (int c = 0; c < int(cows.size()); ++c)
+			_schedule_visit(c);
+	}
+
+	void arrive(int c) {
+		std::vector<int> free;
+		for (int s = 0; s < bus::stations; ++s)
+			if (!station_cow[s])
+				free.push_back(s);
+		if (free.empty()) {
+			cows[c].queued_at = host_sim::Default().now_us;
+			queue.push_back(c);
+			queue_max = std::max(queue_max, queue.size());
+			return;
+		}
+		enter(c, free[std::uniform_int_distribution<size_t>{0, free.size() - 1}(rng)]);
+	}
+	void enter(int c, int s) {
+		auto &sim = host_sim::Default();
+		station_cow[s] = c + 1;
+		cows[c].station = s;
+		cows[c].arrival = sim.now_us;
+		cows[c].visit_rations = 0;
+		sim.at(sim.now_us + std::uniform_int_distribution<uint64_t>{stay_min_us, stay_max_us}(rng), [this, c] { leave(c); });
+	}
+	void leave(int c) {
+		sim_cow &cow = cows[c];
+		const int s = cow.station;
+		station_cow[s] = 0;
+		cow.station = -1;
+		++visits;
+		visits_without_ration += cow.visit_rations == 0;
+		rations_per_visit.add(cow.visit_rations);
+		_schedule_visit(c);
+		if (queue.empty())
+			return;
+		int next = queue.front();
+		queue.pop_front();
+		queue_wait.add((host_sim::Default().now_us - cows[next].queued_at) / 1e6);
+		enter(next, s);
+	}
+
+	/** @brief called for every frame sent by the firmware when its first byte is handed to the uart */
+	void on_frame(uint64_t start, std::string_view frame) {
+		const size_t p3_size = messages::req_p3_0.size();
+		if (frame.size() > p3_size && is_request(frame.substr(0, p3_size), messages::req_p3_0))
+			frame = frame.substr(p3_size); // p3 with the p0 of the next slot, neither is answered
+		const uint64_t end = start + frame.size() * char_time_us;
+		const int s = frame[0] - messages::req_p2[0];
+		if (s < 0 || s >= bus::stations)
+			return;
+		if (is_request(frame, messages::req_p2)) {
+			const int c = station_cow[s] - 1;
+			const int halsband = c < 0 ? 0: cows[c].halsband;
+			char answer[bus::ANSWER_SIZE]{0x6, char('0' + halsband / 100), char('0' + halsband / 10 % 10), char('0' + halsband % 10), 0x4, 0x20};
+			_answer(end, std::string_view{answer, sizeof(answer)});
+		} else if (is_request(frame, messages::req_feed)) {
+			// the dispenser runs on the request, the ack might still get lost
+			const int c = station_cow[s] - 1;
+			if (c < 0) {
+				++rations_to_empty_station;
+			} else {
+				++rations;
+				if (!cows[c].visit_rations++)
+					arrival_to_first_ration.add((end - cows[c].arrival) / 1e6);
+			}
+			_answer(end, "\x06");
+		}
+	}
+
+	/*INTERNAL*/ void _schedule_visit(int c) {
+		auto &sim = host_sim::Default();
+		sim.at(sim.now_us + std::exponential_distribution<double>{1 / visit_interval_us}(rng), [this, c] { arrive(c); });
+	}
+	/*INTERNAL*/ void _answer(uint64_t request_end, std::string_view bytes) {
+		if (std::bernoulli_distribution{drop_rate}(rng)) {
+			++dropped_answers;
+			return;
+		}
+		auto &uart = host_sim::Default().uarts[bus_uart::Default().uart->index];
+		for (size_t i = 0; i < bytes.size(); ++i)
+			uart.receive_at(request_end + answer_delay_us + (i + 1) * char_time_us, bytes[i]);
+	}
+};
+
+/** @brief follows the rations table of the firmware, a ration wait ends when the entry of a cow is removed */
+struct rations_watch {
+	std::map<int, uint64_t> fetched{}; // halsband, fetch time
+	host_samples ration_wait{};
+	double size_sum{};
+	uint64_t samples{}, full_samples{};
+
+	void sample() {
+		auto &rations = rations_in_flight<>::Default();
+		scoped_lock lock{rations.rations_mutex};
+		const auto &table = rations.halsband_rationen;
+		const uint64_t now = host_sim::Default().now_us;
+		std::erase_if(fetched, [&](const auto &f) {
+			if (std::ranges::any_of(table, [&](const halsband_ration &r) { return r.halsband == f.first && r.fetch_time == f.second; }))
+				return false;
+			ration_wait.add((now - f.second) / 60e6);
+			return true;
+		});
+		for (const halsband_ration &r: table)
+			fetched.try_emplace(r.halsband, r.fetch_time);
+		size_sum += table.size();
+		++samples;
+		full_samples += table.size() == int(table.storage.size());
+	}
+};
+
+int main(int argc, char **argv) {
+	host_options opts{argc, argv};
+	if (!opts.args.empty()) {
+		std::fprintf(stderr, "usage: barn_sim [--cows 60] [--kg 4] [--kg_spread 2] [--visit_interval_min 120] [--stay_min_s 60] [--stay_max_s 600] "
+			"[--answer_delay_us 500] [--drop_rate 0] [--hours 24] [--seed 1] [--dispense_timeout 0.5] [--rations 4] [--feeds_per_slot 3] ...\n");
+		return 1;
+	}
+	auto &sim = host_sim::Default();
+	sim.now_us = 1000000;
+	host_firmware firmware{};
+	barn b{opts};
+	b.add_herd();
+	firmware.boot(opts, time_t(opts.get("epoch", 1767225600.)));
+
+	auto &uart = bus_uart::Default();
+	sim.uarts[uart.uart->index].on_tx = [&b, &uart](uint64_t start, char) {
+		if (uart.tx_pos == 0)
+			b.on_frame(start, std::string_view{uart.tx_bytes.data(), size_t(uart.tx_len)});
+	};
+	sim.uarts[uart.uart->index].after_irq = [&b, &uart] { b.rx_buffer_max = std::max(b.rx_buffer_max, uart.rx_write - uart.rx_read); };
+	host_task bus_task{};
+	firmware.start_bus<bus>(bus_task);
+	b.start();
+	rations_watch watch{};
+	const uint64_t duration = opts.get("hours", 24.) * 3600e6;
+	const uint64_t begin = sim.now_us;
+	while (sim.now_us - begin < duration) {
+		sim.run_until(sim.now_us + 10000);
+		watch.sample();
+	}
+
+	const double hours = duration / 3600e6;
+	std::printf("barn: %d stations, %d rations per kg, rec buffer %d, %zu cows, %.1f h\n", bus::stations, SIM_RATIONS_PER_KG, SIM_REC_BUFFER_SIZE, b.cows.size(), hours);
+	const settings &s = settings::Default();
+	std::printf("settings: rations %d, reset_times %d, dispense_timeout %.1f s, feeds_per_slot %d, pipelined %d\n", s.rations, s.reset_times,
+		s.dispense_timeout, station_timing::Default().feeds_per_slot, station_timing::Default().pipelined);
+	std::printf("visits %d, without ration %d, cows waiting for a station max %zu\n", b.visits, b.visits_without_ration, b.queue_max);
+	b.queue_wait.print("wait for a free station", "s");
+	std::printf("throughput: %d rations (%.1f per hour, %.2f kg per hour), %d to an empty station, %d answers dropped\n",
+		b.rations, b.rations / hours, b.rations / hours / SIM_RATIONS_PER_KG, b.rations_to_empty_station, b.dropped_answers);
+	b.rations_per_visit.print("rations per visit", "");
+	b.arrival_to_first_ration.print("arrival to first ration", "s");
+	watch.ration_wait.print("ration wait (fetch to last ration)", "min");
+	std::printf("rations in flight: mean %.1f of %d, full %.2f %% of the time\n", watch.samples ? watch.size_sum / watch.samples: 0.,
+		MAX_RATIONS_IN_FLIGHT, watch.samples ? 100. * watch.full_samples / watch.samples: 0.);
+	std::printf("high water: rx buffer %u of %zu bytes\n", b.rx_buffer_max, uart.rx_bytes.size());
+	firmware.print_report<bus, bus_uart>(duration);
+	return 0;
+}
@@ -0,0 +1,12 @@
+#include "pico/stdlib.h"
+
+// the flash starts erased, persistent_storage checks that the program (__flash_binary_end) ends in front of its journal
+extern "C" {
+alignas(4096) char host_flash[PICO_FLASH_SIZE_BYTES];
+}
+asm(".globl __flash_binary_end\n.set __flash_binary_end, host_flash");
+
+[[maybe_unused]] static const bool host_flash_erased = [] {
+	std::memset(host_flash, 0xff, sizeof(host_flash));
+	return true;
+}();
@@ -0,0 +1,222 @@
+/**
+ * Replays a station bus trace (usb command "trace dump") against the firmware of bus 0 in simulated time.
+ * Every request the firmware sends is matched with the next equal request of the trace, the answers recorded
+ * after it are played back relative to the start of the request. So the firmware runs with its own timing while
+ * the stations behave like in the recording. Requests not found in the trace stay unanswered.
+ * Every cow answering in the trace is added to the herd with --kg kraftfutter per day.
+ *
+ * usage: station_replay <trace file> [--kg 4] [--epoch s] [settings, see host_firmware::boot()]
+ */
+
+#include <fstream>
+#include <sstream>
+
+#include "host_firmware.h"
+
+using bus = futterstationen_bus_0;
+using bus_uart = uart_futterstationen;
+using messages = bus::messages;
+
+/** @brief a single request of the trace with the answer bytes recieved after it */
+struct trace_request {
+	uint64_t start{}; // time the first byte was handed to the uart
+	std::string tx{};
+	std::vector<std::pair<uint64_t, char>> rx{}; // offset to start, byte
+};
+
+static bool is_request(std::string_view f, std::string_view request) { return f.size() == request.size() && f.substr(1) == request.substr(1); }
+static int station_of(std::string_view f) { return f[0] - messages::req_p2[0]; }
+/** @brief halsband in a station answer 0x6 n2 n1 n0 0x4 x, 0 for no or a malformed answer */
+static int answer_halsband(const trace_request &r) {
+	if (r.rx.size() < size_t(bus::ANSWER_SIZE) || r.rx[0].second != 0x6 || r.rx[4].second != 0x4)
+		return 0;
+	int halsband{};
+	for (int i = 1; i < 4; ++i) {
+		char c = r.rx[i].second;
+		if (c < '0' || c > '9')
+			return 0;
+		halsband = halsband * 10 + c - '0';
+	}
+	return halsband;
+}
+/** @brief a p3 directly followed by the p0 of the next slot (frame_gap_us 0) is sent as one frame */
+static std::pair<std::string_view, std::string_view> split_frame(std::string_view frame) {
+	const size_t p3_size = messages::req_p3_0.size();
+	if (frame.size() > p3_size && is_request(frame.substr(0, p3_size), messages::req_p3_0))
+		return {frame.substr(0, p3_size), frame.substr(p3_size)};
+	return {frame, {}};
+}
+static std::string hex(std::string_view s) {
+	std::string r;
+	for (char c: s) {
+		if (!r.empty())
+			r += ' ';
+		r += static_format<4>("{:02x}", uint8_t(c));
+	}
+	return r;
+}
+
+/** @brief reads the requests of the trace, a tx byte starts a new frame after recieved bytes or a pause in sending */
+static std::vector<trace_request> parse_trace(std::istream &in, uint32_t char_time_us) {
+	std::vector<trace_request> frames;
+	uint64_t time{}, last_tx{};
+	uint32_t last_raw{};
+	bool first{true}, after_rx{};
+	for (std::string line; std::getline(in, line);) {
+		std::istringstream l{line};
+		uint32_t raw{};
+		std::string dir;
+		unsigned data{};
+		if (!(l >> raw >> dir >> std::hex >> data) || (dir != "tx" && dir != "rx"))
+			continue; // header line
+		time = first ? raw: time + uint32_t(raw - last_raw); // the trace stores the lower 32 bit of the time
+		last_raw = raw;
+		first = false;
+		if (dir == "rx") {
+			if (!frames.empty())
+				frames.back().rx.emplace_back(time - frames.back().start, char(data));
+			after_rx = true;
+			continue;
+		}
+		if (frames.empty() || after_rx || time > last_tx + char_time_us * 3 / 2)
+			frames.push_back(trace_request{.start = time});
+		frames.back().tx += char(data);
+		last_tx = time;
+		after_rx = false;
+	}
+	std::vector<trace_request> requests;
+	for (trace_request &f: frames) {
+		auto [first_request, second_request] = split_frame(f.tx);
+		if (second_request.empty()) {
+			requests.push_back(std::move(f));
+			continue;
+		}
+		requests.push_back(trace_request{.start = f.start, .tx = std::string(first_request)});
+		requests.push_back(trace_request{.start = f.start + first_request.size() * char_time_us, .tx = std::string(second_request), .rx = std::move(f.rx)});
+		for (auto &[offset, data]: requests.back().rx)
+			offset -= first_request.size() * char_time_us;
+	}
+	return requests;
+}
+
+/** @brief plays the trace back to the requests of the firmware and collects the timing of the bus */
+struct replay {
+	constexpr static int MATCH_WINDOW{8}; // requests of the trace skipped at most to find the one sent, about a slot
+	const std::vector<trace_request> &trace;
+	uint32_t char_time_us{};
+	size_t pos{}; // next request of the trace
+	int sent{}, matched{}, skipped{}, unknown{};
+	std::string first_unknown{};
+	uint64_t first_start{}, last_start{}, last_p0{};
+	std::array<int, bus::stations> station_cow{};
+	std::array<uint64_t, bus::stations> detected_at{};
+	host_samples slot_cycles{}, detection_to_dispense{};
+
+	bool done() const { return pos >= trace.size(); }
+	/** @brief called for every frame sent by the firmware when its first byte is handed to the uart */
+	void on_frame(uint64_t start, std::string_view frame) {
+		auto [first_request, second_request] = split_frame(frame);
+		on_request(start, first_request);
+		if (!second_request.empty())
+			on_request(start + first_request.size() * char_time_us, second_request);
+	}
+	void on_request(uint64_t start, std::string_view request) {
+		if (done())
+			return;
+		if (!sent++)
+			first_start = start;
+		last_start = start;
+		// the address of p2 and feed requests is the station, anything else in a foreign or corrupt trace is no station of the bus
+		const int station = station_of(request);
+		const bool to_station = station >= 0 && station < bus::stations;
+		if (is_request(request, messages::req_p0)) {
+			if (last_p0)
+				slot_cycles.add((start - last_p0) / 1000.);
+			last_p0 = start;
+		} else if (to_station && is_request(request, messages::req_feed) && detected_at[station]) {
+			detection_to_dispense.add((start - detected_at[station]) / 1000.);
+			detected_at[station] = 0;
+		}
+		size_t end = std::min(trace.size(), pos + MATCH_WINDOW);
+		size_t match = pos;
+		while (match < end && trace[match].tx != request)
+			++match;
+		if (match == end) {
+			if (!unknown++)
+				first_unknown = static_format<64>("{} at {:.3f} s", hex(request), start / 1e6);
+			return;
+		}
+		++matched;
+		skipped += match - pos;
+		pos = match + 1;
+		auto &sim = host_sim::Default();
+		for (auto [offset, data]: trace[match].rx)
+			sim.uarts[bus_uart::Default().uart->index].receive_at(start + offset, data);
+		if (to_station && is_request(request, messages::req_p2)) {
+			int halsband = answer_halsband(trace[match]);
+			if (halsband != station_cow[station])
+				detected_at[station] = halsband ? start + trace[match].rx[bus::ANSWER_SIZE - 1].first: 0;
+			station_cow[station] = halsband;
+		}
+	}
+};
+
+int main(int argc, char **argv) {
+	host_options opts{argc, argv};
+	if (opts.args.size() != 1) {
+		std::fprintf(stderr, "usage: station_replay <trace file> [--kg 4] [--epoch s] [--pipelined 1] [--hw_timer 0] [--frame_gap_us 10000] "
+			"[--feeds_per_slot 3] [--dispense_timeout 0.5] [--rations 4] [--timeout_p2_us 85000] ...\n");
+		return 1;
+	}
+	std::ifstream file{opts.args[0]};
+	if (!file) {
+		std::fprintf(stderr, "Could not open %s\n", opts.args[0].c_str());
+		return 1;
+	}
+	const uint32_t char_time_us = bus_uart::CHAR_TIME_US;
+	const std::vector<trace_request> trace = parse_trace(file, char_time_us);
+	if (trace.empty()) {
+		std::fprintf(stderr, "No request in the trace\n");
+		return 1;
+	}
+
+	auto &sim = host_sim::Default();
+	sim.now_us = 1000000;
+	host_firmware firmware{};
+	const float kg = opts.get("kg", 4.);
+	int answer_bytes{};
+	for (const trace_request &r: trace) {
+		answer_bytes += r.rx.size();
+		if (int h = answer_halsband(r); h && is_request(r.tx, messages::req_p2) && kuhspeicher::Default().find_cow_by_halsband(h) < 0)
+			firmware.add_cow(h, kg);
+	}
+	firmware.boot(opts, time_t(opts.get("epoch", 1767225600.)));
+	// start with the station polled first in the trace
+	auto p2 = std::find_if(trace.begin(), trace.end(), [](const trace_request &r) { return is_request(r.tx, messages::req_p2); });
+	if (p2 != trace.end() && station_of(p2->tx) >= 0 && station_of(p2->tx) < bus::stations)
+		bus::Default().cur_station = station_of(p2->tx);
+
+	replay r{.trace = trace, .char_time_us = char_time_us};
+	auto &uart = bus_uart::Default();
+	sim.uarts[uart.uart->index].on_tx = [&r, &uart](uint64_t start, char) {
+		if (uart.tx_pos == 0)
+			r.on_frame(start, std::string_view{uart.tx_bytes.data(), size_t(uart.tx_len)});
+	};
+	host_task bus_task{};
+	firmware.start_bus<bus>(bus_task);
+	const uint64_t trace_duration = trace.back().start - trace.front().start;
+	const uint64_t begin = sim.now_us;
+	while (!r.done() && sim.now_us - begin < 2 * trace_duration + 10000000)
+		sim.run_until(sim.now_us + 10000);
+	sim.run_until(sim.now_us + 500000); // answers of the last request
+	const uint64_t duration = r.last_start - r.first_start;
+
+	std::printf("trace: %zu requests, %d answer bytes, %.2f s\n", trace.size(), answer_bytes, trace_duration / 1e6);
+	std::printf("replay: %d requests in %.2f s, %.1f requests/s\n", r.sent, duration / 1e6, std::max(r.sent - 1, 0) * 1e6 / std::max<uint64_t>(duration, 1));
+	std::printf("requests matched %d, trace requests skipped %d, not in the trace %d%s%s\n", r.matched, r.skipped + int(trace.size() - r.pos),
+		r.unknown, r.unknown ? ", first ": "", r.first_unknown.c_str());
+	r.slot_cycles.print("slot cycles (p0 to p0)", "ms");
+	r.detection_to_dispense.print("detection to dispense", "ms");
+	firmware.print_report<bus, bus_uart>(duration);
+	return 0;
+}
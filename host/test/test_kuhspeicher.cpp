@@ -0,0 +1,132 @@
+/**
+ * Checks of the ram indices of kuhspeicher against the cows stored in flash.
+ */
+
+#include <chrono>
+
+#include "host_check.h"
+
+static int halsband_of(int idx) { return idx < 0 ? -1: kuhspeicher::Default().cows_view()[idx].halsbandnr; }
+static std::string name_of(int idx) { return idx < 0 ? std::string{}: std::string(kuhspeicher::Default().cows_view()[idx].name.sv()); }
+
+/** @brief two cows sharing a halsband, deleting or renumbering the indexed one keeps the other one findable */
+static void check_shared_halsband() {
+	auto &k = kuhspeicher::Default();
+	k.clear();
+	host_firmware::add_cow(7, 4, "anna");
+	host_firmware::add_cow(8, 4, "berta");
+	host_firmware::add_cow(7, 4, "clara");
+	HOST_CHECK(halsband_of(k.find_cow_by_halsband(7)) == 7);
+
+	// the index points to one of both, delete exactly that one
+	const std::string indexed = name_of(k.find_cow_by_halsband(7));
+	const std::string other = indexed == "anna" ? "clara": "anna";
+	HOST_CHECK(k.delete_cow(indexed));
+	HOST_CHECK(name_of(k.find_cow_by_halsband(7)) == other);
+	HOST_CHECK(name_of(k.find_cow_by_halsband(8)) == "berta");
+
+	// the same when the indexed cow gets another halsband
+	host_firmware::add_cow(7, 4, "dora");
+	const std::string renumbered = name_of(k.find_cow_by_halsband(7));
+	host_firmware::add_cow(9, 4, renumbered);
+	HOST_CHECK(name_of(k.find_cow_by_halsband(9)) == renumbered);
+	HOST_CHECK(halsband_of(k.find_cow_by_halsband(7)) == 7);
+	HOST_CHECK(name_of(k.find_cow_by_halsband(7)) != renumbered);
+
+	// the last cow with the halsband is gone
+	HOST_CHECK(k.delete_cow(name_of(k.find_cow_by_halsband(7))));
+	HOST_CHECK(k.find_cow_by_halsband(7) < 0);
+}
+
+/** @brief worst case of the boot: a full herd with full feed rings, the newest feeds spread over all cows.
+  * Checks the merge against sorting all feeds and prints the time it takes on the host */
+static void check_reload_last_feeds_full_herd() {
+	auto &k = kuhspeicher::Default();
+	k.clear();
+	constexpr uint32_t FIRST_FEED{29446560}; // 2026-01-01 in minutes
+	const int feeds = kuh{}.letzte_fuetterungen.storage.size();
+	// cow i feeds at slot (j * MAX_COWS + order[i]), so every cow holds some of the newest feeds in turn
+	std::array<int, MAX_COWS> order{};
+	for (int i = 0; i < MAX_COWS; ++i)
+		order[i] = i * 97 % MAX_COWS;
+	k.begin_batch();
+	for (int i = 0; i < MAX_COWS; ++i) {
+		kuh c{};
+		c.name.fill_formatted("cow{}", i);
+		c.halsbandnr = i + 1;
+		c.kraftfuttermenge = 4;
+		for (int j = 0; j < feeds; ++j)
+			c.letzte_fuetterungen.push(feed_entry{.station = uint8_t(i % 8), .timestamp = FIRST_FEED + uint32_t(j * MAX_COWS + order[i])});
+		HOST_CHECK(k.write_or_create_cow(c));
+	}
+	HOST_CHECK(k.commit());
+	HOST_CHECK(k.cows_size() == MAX_COWS);
+
+	std::vector<uint32_t> all;
+	auto cows = k.cows_view();
+	for (const kuh &c: cows)
+		for (const feed_entry &f: c.letzte_fuetterungen)
+			all.push_back(f.timestamp);
+	std::sort(all.begin(), all.end());
+	const int newest = k.last_feeds.storage.size();
+
+	uint64_t min_ns{~0ull}, max_ns{};
+	for (int run = 0; run < 10; ++run) {
+		auto start = std::chrono::steady_clock::now();
+		k.reload_last_feeds();
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		min_ns = std::min(min_ns, ns);
+		max_ns = std::max(max_ns, ns);
+	}
+	HOST_CHECK(k.last_feeds.size() == newest);
+	for (int i = 0; i < k.last_feeds.size(); ++i) {
+		auto [cow_idx, feed_idx] = k.last_feeds[i];
+		HOST_CHECK(cows[cow_idx].letzte_fuetterungen.storage[feed_idx].timestamp == all[all.size() - newest + i]);
+	}
+	std::printf("reload_last_feeds of %d cows with %d feeds each: %.1f to %.1f us on the host, %d cow records (%zu bytes each) read\n",
+		MAX_COWS, feeds, min_ns / 1e3, max_ns / 1e3, MAX_COWS + newest, sizeof(kuh));
+}
+
+/** @brief a herd upload breaking off in the middle of a line: only the complete cows are imported, the cut line neither
+  * on abort nor as last line of a finished upload. The import waits for the journal compaction instead of doing it itself */
+static void check_herd_import_abort() {
+	auto &k = kuhspeicher::Default();
+	auto &storage = persistent_storage_t::Default();
+	k.clear();
+	host_firmware::add_cow(1, 4, "anna");
+	HOST_CHECK(storage.flush() == PICO_OK);
+	HOST_CHECK(storage._journal_pos > 0);
+	HOST_CHECK(k.import_begin() == import_start::STORAGE_BUSY);
+	HOST_CHECK(!k.import_active);
+	storage.maintain();
+	HOST_CHECK(storage._journal_pos == 0);
+
+	HOST_CHECK(k.import_begin() == import_start::STARTED);
+	HOST_CHECK(k.import_begin() == import_start::RUNNING);
+	k.import_chunk(R"({"name":"berta","knr":2,"halsbandnr":2,"kraftfuttermenge":4,"abkalbungstag":20000})" "\n");
+	k.import_chunk(R"({"name":"clara","knr":3,"halsbandnr":3,"kraftfuttermenge":4,"abkal)");
+	k.import_chunk(R"(bungstag":200)"); // cut within the last value, the json parser would take the line
+	k.import_abort();
+	HOST_CHECK(!k.import_active);
+	HOST_CHECK(k.import_count == 1);
+	HOST_CHECK(name_of(k.find_cow_by_halsband(2)) == "berta");
+	HOST_CHECK(k.find_cow_by_halsband(3) < 0);
+
+	HOST_CHECK(k.import_begin() == import_start::STORAGE_BUSY); // the commit of the abort wrote journal records
+	storage.maintain();
+	HOST_CHECK(k.import_begin() == import_start::STARTED);
+	k.import_chunk(R"({"name":"dora","knr":4,"halsbandnr":4,"kraftfuttermenge":4,"abkalbungstag":20000})" "\r\n"
+		R"({"name":"emma","knr":5,"halsbandnr":5,"kraftfuttermenge":4,"abkalbungstag":200)");
+	HOST_CHECK(k.import_end());
+	HOST_CHECK(k.import_count == 1 && k.import_errors == 1);
+	HOST_CHECK(name_of(k.find_cow_by_halsband(4)) == "dora");
+	HOST_CHECK(k.find_cow_by_halsband(5) < 0);
+}
+
+int main(int argc, char **argv) {
+	host_check_boot(argc, argv);
+	check_shared_halsband();
+	check_reload_last_feeds_full_herd();
+	check_herd_import_abort();
+	return host_check_failures;
+}
@@ -0,0 +1,106 @@
+/**
+ * Checks of persistent_storage for cases which can not be provoked on the device, like a reset between two flash operations.
+ */
+
+#include <memory>
+#include <vector>
+
+#include "host_check.h"
+
+using layout = persistent_storage_layout;
+
+/** @brief a storage like after a reset: ram state lost, journal loaded from flash */
+static std::unique_ptr<persistent_storage_t> reboot() {
+	auto s = std::make_unique<persistent_storage_t>();
+	s->_journal_load();
+	return s;
+}
+static std::string stored_pwd(const persistent_storage_t &s) {
+	static_string<64> pwd{};
+	s.read(&layout::user_pwd, pwd);
+	return std::string(pwd.sv());
+}
+static int stored_cows_size(const persistent_storage_t &s) {
+	int size{};
+	s.read(&layout::cows_size, size);
+	return size;
+}
+/** @brief compares all bytes, view() resolves the member as a single record */
+static bool viewed_pwd_is(const persistent_storage_t &s, const static_string<64> &expected) {
+	const static_string<64> pwd = s.view(&layout::user_pwd);
+	return memcmp(&pwd, &expected, sizeof(pwd)) == 0;
+}
+
+/** @brief a value is overwritten in a later journal sector, the compaction is cut before every single flash operation in turn.
+  * After the reset the newest values have to be read, an older record left in the journal must not be replayed */
+static void check_interrupted_compaction() {
+	auto &sim = host_sim::Default();
+	auto s = reboot();
+	HOST_CHECK(s->write(1, &layout::cows_size) == PICO_OK);
+	HOST_CHECK(s->flush() == PICO_OK);
+	static_string<64> pwd{};
+	for (int i = 0; s->_journal_pos < 2 * FLASH_SECTOR_SIZE; ++i) {
+		pwd.fill_formatted("pwd{}", i);
+		HOST_CHECK(s->write(pwd, &layout::user_pwd) == PICO_OK);
+		HOST_CHECK(s->flush() == PICO_OK);
+	}
+	HOST_CHECK(s->write(2, &layout::cows_size) == PICO_OK);
+	HOST_CHECK(s->flush() == PICO_OK);
+	const std::string newest_pwd{pwd.sv()};
+	const std::vector<char> before(host_flash, host_flash + PICO_FLASH_SIZE_BYTES);
+
+	for (int cut = 0;; ++cut) {
+		std::copy(before.begin(), before.end(), host_flash);
+		s = reboot();
+		HOST_CHECK(s->_journal_pos > 2 * FLASH_SECTOR_SIZE);
+		sim.flash_ops_until_power_cut = cut;
+		bool completed{};
+		try {
+			HOST_CHECK(s->compact() == PICO_OK);
+			completed = true;
+		} catch (const host_power_cut&) {}
+		sim.flash_ops_until_power_cut = -1;
+		s = reboot();
+		HOST_CHECK(stored_cows_size(*s) == 2);
+		HOST_CHECK(stored_pwd(*s) == newest_pwd);
+		// the journal takes new records again
+		HOST_CHECK(s->write(3, &layout::cows_size) == PICO_OK);
+		HOST_CHECK(s->flush() == PICO_OK);
+		s = reboot();
+		HOST_CHECK(stored_cows_size(*s) == 3);
+		HOST_CHECK(stored_pwd(*s) == newest_pwd);
+		if (completed)
+			break;
+	}
+}
+
+/** @brief a part of a member written as its own record, in the write-back cache and in the journal, then the whole member is read */
+static void check_overlapping_partial_write() {
+	auto s = reboot();
+	static_string<64> pwd{};
+	pwd.fill_formatted("{}", "0123456789abcdef");
+	HOST_CHECK(s->write(pwd, &layout::user_pwd) == PICO_OK);
+	HOST_CHECK(s->flush() == PICO_OK);
+	static_string<64> expected{pwd};
+	const uint32_t offset = s->_member_offset(&layout::user_pwd);
+	memcpy(reinterpret_cast<char*>(&expected) + 4, "WXYZ", 4);
+	HOST_CHECK(s->_cache_write(offset + 4, "WXYZ", 4) == PICO_OK);
+	HOST_CHECK(viewed_pwd_is(*s, expected));
+	HOST_CHECK(s->flush() == PICO_OK);
+	HOST_CHECK(viewed_pwd_is(*s, expected));
+	// a differently sized record at the same offset
+	memcpy(reinterpret_cast<char*>(&expected), "wxyz", 4);
+	HOST_CHECK(s->_cache_write(offset, "wxyz", 4) == PICO_OK);
+	HOST_CHECK(viewed_pwd_is(*s, expected));
+	HOST_CHECK(s->flush() == PICO_OK);
+	HOST_CHECK(viewed_pwd_is(*s, expected));
+	s = reboot();
+	HOST_CHECK(viewed_pwd_is(*s, expected));
+}
+
+int main(int, char **) {
+	host_sim::Default().now_us = 1000000;
+	check_interrupted_compaction();
+	check_overlapping_partial_write();
+	return host_check_failures;
+}
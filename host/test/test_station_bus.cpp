@@ -0,0 +1,117 @@
+/**
+ * Checks of the station bus timing against a station answering on the simulated uart.
+ */
+
+#include "host_check.h"
+
+using bus = futterstationen_bus_0;
+using bus_uart = uart_futterstationen;
+using messages = bus::messages;
+
+static bool is_request(std::string_view f, std::string_view request) { return f.size() == request.size() && f.substr(1) == request.substr(1); }
+
+/** @brief a cow stays in station 0, the lone ack of every feed has to wake the bus task before the feed timeout */
+static void check_feed_ack_wakes_bus() {
+	constexpr int halsband{5};
+	constexpr uint64_t answer_delay_us{500};
+	auto &sim = host_sim::Default();
+	auto &uart = bus_uart::Default();
+	auto &sim_uart = sim.uarts[uart.uart->index];
+	host_firmware::add_cow(halsband, 8);
+	uint64_t ack_at{}, woken_at{};
+	sim_uart.on_tx = [&](uint64_t start, char) {
+		if (uart.tx_pos != 0)
+			return;
+		const std::string_view frame{uart.tx_bytes.data(), size_t(uart.tx_len)};
+		const uint64_t end = start + frame.size() * bus_uart::CHAR_TIME_US;
+		if (frame[0] != messages::req_p2[0])
+			return; // only station 0 is taken
+		if (is_request(frame, messages::req_p2)) {
+			const char answer[bus::ANSWER_SIZE]{0x6, '0', '0', '0' + halsband, 0x4, 0x20};
+			for (int i = 0; i < bus::ANSWER_SIZE; ++i)
+				sim_uart.receive_at(end + answer_delay_us + (i + 1) * bus_uart::CHAR_TIME_US, answer[i]);
+		} else if (is_request(frame, messages::req_feed) && !ack_at) {
+			ack_at = end + answer_delay_us + bus_uart::CHAR_TIME_US;
+			sim_uart.receive_at(ack_at, 0x6);
+		}
+	};
+	host_task bus_task{};
+	bus::Default().started = true;
+	bus_task.step = [&] {
+		if (ack_at && !woken_at && bus::Default().state == bus::await_ack_feed)
+			woken_at = sim.now_us;
+		return bus::Default().handle_station_communication();
+	};
+	bus_task.start();
+	const uint64_t begin = sim.now_us;
+	while (!woken_at && sim.now_us - begin < 60000000)
+		sim.run_until(sim.now_us + 10000);
+	sim_uart.on_tx = {};
+
+	HOST_CHECK(ack_at && woken_at);
+	const uint64_t feed_timeout_us = station_timing::Default().frame_timeouts_us[station_timing::feed];
+	std::printf("feed ack at %.3f s, bus task woken %llu us later, feed timeout %llu us\n", ack_at / 1e6,
+		(unsigned long long)(woken_at - ack_at), (unsigned long long)feed_timeout_us);
+	// the task wakes on the notification, at most a tick after the ack
+	HOST_CHECK(woken_at >= ack_at && woken_at - ack_at <= 1000);
+}
+
+/** @brief the rations table survives a reset in the retained ram, a fetch whose feed entry was lost with the write-back cache is dropped */
+static void check_rations_survive_reset() {
+	auto &rations = rations_in_flight<>::Default();
+	auto &storage = persistent_storage_t::Default();
+	const auto fetch = [&](int halsband) {
+		const uint32_t minute = ntp_client::Default().get_time_since_epoch() / 60;
+		const float amount = kuhspeicher::Default().feed_cow(halsband, 0);
+		scoped_lock lock{rations.rations_mutex};
+		halsband_ration *entry = rations.halsband_rationen.push();
+		*entry = {.halsband = halsband, .rations_count = int(amount * 10), .fetch_time = time_us_64(), .fetch_minute = minute};
+		rations.store();
+		return entry->rations_count;
+	};
+	const auto rations_of = [&](int halsband) {
+		scoped_lock lock{rations.rations_mutex};
+		const halsband_ration *entry = rations.halsband_rationen | find{halsband, &halsband_ration::halsband};
+		return entry ? entry->rations_count: -1;
+	};
+	{
+		scoped_lock lock{rations.rations_mutex};
+		rations.halsband_rationen.clear();
+		rations.store();
+	}
+	host_firmware::add_cow(11, 8);
+	host_firmware::add_cow(12, 8);
+	const int rations_11 = fetch(11);
+	HOST_CHECK(rations_11 > 0);
+	HOST_CHECK(storage.flush() == PICO_OK);
+	HOST_CHECK(fetch(12) > 0);
+	const uint32_t pages_programmed = storage.stats.pages_programmed;
+	{
+		scoped_lock lock{rations.rations_mutex};
+		--rations.halsband_rationen.begin()->rations_count; // a ration dispensed
+		rations.store();
+	}
+	HOST_CHECK(storage.stats.pages_programmed == pages_programmed);
+
+	// reset before the feed entry of cow 12 left the write-back cache
+	storage._dirty.clear();
+	storage._dirty_pos = 0;
+	rations.load();
+	HOST_CHECK(rations_of(11) == rations_11 - 1);
+	HOST_CHECK(rations_of(12) == -1);
+	// a second reset restores the same
+	rations.load();
+	HOST_CHECK(rations_of(11) == rations_11 - 1);
+
+	// power on, the ram holds anything
+	retained_rations::Default().checksum ^= 1;
+	rations.load();
+	HOST_CHECK(rations_of(11) == -1);
+}
+
+int main(int argc, char **argv) {
+	host_check_boot(argc, argv);
+	check_feed_ack_wakes_bus();
+	check_rations_survive_reset();
+	return host_check_failures;
+}
@@ -2,14 +2,122 @@
 
 #include <string_view>
 #include <array>
+#include <utility>
+#include <limits>
+#include <iostream>
+#include <atomic>
+#include <cstddef>
+#include <span>
 #include "static_types.h"
 #include "mutex.h"
 #include "uart_storage.h"
 #include "ranges_util.h"
 #include "kuhspeicher.h"
+#include "measurements.h"
 
-template<int MAX_STATIONS = 4, int RATIONS_PER_KG = 10, int MAX_RATIONS_IN_FLIGHT = 64, int REC_BUFFER_SIZE = 32>
+/** @brief Per station counters of the frame decoder to diagnose bus problems */
+struct station_bus_stats {
+	uint32_t good_frames{};
+	uint32_t framing_errors{}; // wrong digit, missing 0x4 terminator, truncated frame or stray byte
+	uint32_t timeouts{}; // no answer to a request (station 0 does not answer if empty)
+	uint32_t late_answers{}; // answer started after the request was already evaluated
+};
+
+/** @brief prints the bus statistics formatted for monospace output, eg. usb */
+std::ostream& operator<<(std::ostream &os, const station_bus_stats &b) {
+	os << "good " << b.good_frames << ", framing errors " << b.framing_errors << ", timeouts " << b.timeouts << ", late " << b.late_answers << '\n';
+	return os;
+}
+
+struct halsband_ration {
+	int halsband;
+	int rations_count;
+	uint64_t fetch_time; // time the rations were fetched by kuhspeicher::feed_cow()
+	uint32_t fetch_minute; // minutes since epoch before the fetch, its feed entry is not older
+};
+
+/** @brief Copy of the rations table in ram which is not cleared at boot, so it survives a watchdog reset or /reboot but no power cut.
+  * A valid checksum tells it apart from the random content after power on */
+struct retained_rations {
+	static constexpr uint32_t MAGIC{0x52544e52}; // "RNTR"
+	struct entry {
+		uint16_t halsband;
+		uint16_t rations_count;
+		uint32_t fetch_minute;
+	};
+	uint32_t magic;
+	uint32_t count;
+	std::array<entry, MAX_RATIONS_IN_FLIGHT> rations;
+	uint32_t checksum;
+
+	static retained_rations& Default() {
+		static retained_rations __uninitialized_ram(r);
+		return r;
+	}
+
+	uint32_t compute_checksum() const { return fnv1a(std::string_view{reinterpret_cast<const char*>(this), offsetof(retained_rations, checksum)}); }
+	bool valid() const { return magic == MAGIC && count <= uint32_t(MAX_RATIONS_IN_FLIGHT) && checksum == compute_checksum(); }
+};
+
+/** @brief Rations fetched for cows but not yet dispensed. Shared by all buses, as a cow
+  * can walk to a station on another bus, the mutex has to be held for every access.
+  * Every change is stored with store(), see there */
+template<int N = MAX_RATIONS_IN_FLIGHT>
+struct rations_in_flight {
+	static_assert(N <= MAX_RATIONS_IN_FLIGHT, "The retained copy holds at most MAX_RATIONS_IN_FLIGHT rations");
+	mutex rations_mutex{};
+	static_vector<halsband_ration, N, uint8_t> halsband_rationen{};
+
+	static rations_in_flight& Default() {
+		static rations_in_flight r{};
+		return r;
+	}
+
+	/** @brief copies the table to retained_rations, to be called with the locked mutex after every change.
+	  * No flash io, the feed entry of a fetch goes through the write-back cache and is checked by load() */
+	void store() const {
+		retained_rations &r = retained_rations::Default();
+		r.magic = retained_rations::MAGIC;
+		r.count = halsband_rationen.size();
+		for (int i = 0; i < int(halsband_rationen.size()); ++i)
+			r.rations[i] = {.halsband = uint16_t(halsband_rationen[i].halsband), .rations_count = uint16_t(halsband_rationen[i].rations_count),
+					.fetch_minute = halsband_rationen[i].fetch_minute};
+		r.checksum = r.compute_checksum();
+	}
+	/** @brief restores the rations retained over the last reset, has to be called after the cows are loaded and before the buses
+	  * are started. Rations without a stored feed of the cow since their fetch were lost together with the write-back cache,
+	  * the cow was not charged for them and fetches them again */
+	void load() {
+		scoped_lock lock{rations_mutex};
+		const retained_rations &r = retained_rations::Default();
+		halsband_rationen.clear();
+		if (r.valid()) {
+			int dropped{};
+			for (const retained_rations::entry &e: std::span{r.rations.data(), std::min<size_t>(r.count, N)}) {
+				if (!kuhspeicher::Default().has_feed_since(e.halsband, e.fetch_minute)) {
+					++dropped;
+					continue;
+				}
+				halsband_rationen.push(halsband_ration{.halsband = e.halsband, .rations_count = e.rations_count, .fetch_time = time_us_64(),
+									.fetch_minute = e.fetch_minute});
+			}
+			LogInfo("Restored rations in flight for {} cows, dropped {} without stored feed", halsband_rationen.size(), dropped);
+		}
+		store();
+	}
+};
+
+/**
+ * @brief Driver for one bus of feeding stations connected to the uart uart_t.
+ * Every bus runs its own state machine (call handle_station_communication() from a separate task per bus),
+ * the local stations 0..MAX_STATIONS-1 of the bus are stored with the global id STATION_OFFSET + local station.
+ */
+template<typename uart_t = uart_futterstationen, int MAX_STATIONS = 4, int STATION_OFFSET = 0, int RATIONS_PER_KG = 10, int REC_BUFFER_SIZE = 32>
 struct kraftfutterstation {
+	static_assert(MAX_STATIONS <= 16, "Station addresses are '@' + local station");
+	static_assert(STATION_OFFSET + MAX_STATIONS - 1 <= MAX_STATION_ID, "Global station ids have to fit into feed_entry::station");
+	static constexpr int station_offset{STATION_OFFSET};
+	static constexpr int stations{MAX_STATIONS};
 	// communication messages
 	// the main computer initiates the communication by sending the messages
 	// req_p0 req_p1 (req_p2_0 | req_p2_1 | req_p2_2 | req_p2_3) (req_p3_0 | req_p3_1)
@@ -19,21 +127,37 @@ struct kraftfutterstation {
 	// 0x6 n2 n1 n0 0x4 0x20
 	// 0x6 n2 n1 n0 0x4 0x1e
 	// 0x6 0 0 0 0x4 0x14
+	// A frame is rejected (see station_bus_stats) if a digit is not in '0'-'9', the 0x4 is missing
+	// or the gap between two bytes exceeds MAX_BYTE_GAP_US
 	// Feed msg:
 	// @S1 0x4 0x8 is acked with 0x06 for feed at station 0
 	// AS1 0x4 0x8 is acked with 0x06 for feed at station 1
-	struct message_timeout {
-		std::string_view message{};
-		uint32_t timeout{};
-	};
+	// The timeouts of the messages are configured in station_timing
 	struct messages {
-		constexpr static message_timeout 
-			req_p0 = {"`RR",60000},
-			req_p1 = {"aRR",60000},  // req_p1,
-			req_p2 = {"@R\u0004V", 85000}, // req_p2 as template replace @,
-			req_feed = {"@S1\u0004\u0008", 60000}, // req_f template for feeed, replace @ with the corerct
-			req_p3_0 = {"\u00011\u00045", 70000}, // req_p3_0
-			req_p3_1 = {"\u00111\u00045", 70000}; // req_p3_1
+		constexpr static std::string_view 
+			req_p0 = {"`RR"},
+			req_p1 = {"aRR"},  // req_p1,
+			req_p2 = {"@R\u0004V"}, // req_p2 as template replace @,
+			req_feed = {"@S1\u0004\u0008"}, // req_f template for feeed, replace @ with the corerct
+			req_p3_0 = {"\u00011\u00045"}, // req_p3_0
+			req_p3_1 = {"\u00111\u00045"}; // req_p3_1
+	};
+	constexpr static int ANSWER_SIZE{6}; // 0x6 n2 n1 n0 0x4 x
+	constexpr static uint64_t MAX_BYTE_GAP_US{3 * uart_t::CHAR_TIME_US}; // larger gaps end a frame
+	// polling schedule: a station empty for IDLE_POLLS_PER_BACKOFF polls is skipped in every second turn,
+	// after twice as many polls in 3 of 4 turns and so on, up to being polled only every (1 << MAX_BACKOFF)-th turn
+	constexpr static int IDLE_POLLS_PER_BACKOFF{4};
+	constexpr static int MAX_BACKOFF{3};
+	constexpr static uint64_t TIMED_LEAD_US{5000}; // with station_timing::hw_timer the task prepares a frame this early
+	// further rations are only dispensed in the same slot if the dispenser is ready again within this time, else the other
+	// stations are polled first. Keeps every wait of the bus task well below the watchdog timeout
+	constexpr static uint64_t MAX_SLOT_WAIT_US{200000};
+	enum decode_state {
+		expect_ack,
+		expect_digit,
+		expect_terminator,
+		expect_trailer,
+		skip_frame, // rest of a malformed frame, ignored up to the next 0x6 or gap
 	};
 	enum state {
 		send_req_p0,
@@ -50,60 +174,149 @@ struct kraftfutterstation {
 		return station;
 	}
 
-	struct halsband_ration {
-		int halsband;
-		int rations_count;
-	};
-
 	struct rec_package {
 		uint64_t ack_time{};
 		int halsband{};
 	};
 
 	state state{send_req_p0};
-	static_vector<halsband_ration, MAX_RATIONS_IN_FLIGHT, uint8_t> halsband_rationen{};
 	std::array<uint64_t, MAX_STATIONS> station_last_feeds{};
 	std::array<int, MAX_STATIONS> station_cur_cow{};
-	mutex receive_mutex{};
+	std::array<uint8_t, MAX_STATIONS> station_idle_polls{}; // polls in a row without a cow in the station
+	std::array<uint8_t, MAX_STATIONS> station_skipped{}; // turns the station was skipped since its last poll
+	std::array<uint64_t, MAX_STATIONS> station_arrival{}; // time the current cow entered the station, 0 after its first ration
 	static_ring_buffer<rec_package, REC_BUFFER_SIZE, uint8_t> received_packages{};
+	std::array<station_bus_stats, MAX_STATIONS> bus_stats{};
+	decode_state decode_state{expect_ack};
+	int decode_digits{};
+	int decode_halsband{};
+	int decode_station{}; // station the frame in decoding is counted for
+	uint64_t decode_last_time{};
+	int request_station{}; // station of the last request with answer
+	int prev_request_station{}; // station of the request before, late answers are counted for it
 	static_string<16> send_buffer{};
 	uint64_t cow_request_time{};
+	uint64_t frame_time{}; // time the current step is due, for frames the time they are (to be) sent
+	int hw_timer{}; // mode of the last step, the jitter histogram is restarted on a change
+	int slot_feeds{}; // rations dispensed in the current slot of cur_station
 	int cur_station{};
+	std::atomic<bool> started{}; // set by the bus task, the uart of a bus not started at boot is never initialized
 
-	// BLOCKING
-	// Raw recieve task, does only queue the recieved packages
-	void receive_packages() {
-		int pos_after_ack{};
-		for (;;) {
-			char data = uart_futterstationen::Default().getc();
-			uint64_t receive_time = time_us_64();
-			bool timeout{};
-			{
-				scoped_lock lock{receive_mutex};
-				uint64_t del_pack_start = receive_time - received_packages.back().ack_time;
-				static constexpr uint64_t max_package_del = 40000;
-				timeout = del_pack_start > max_package_del;
-			}
-			if (data == 0x6) {
-				pos_after_ack = 0;
-				LogInfo("Recieved ACK package");
-				scoped_lock lock{receive_mutex};
-				received_packages.push({.ack_time = receive_time});
-			}
-			else if (pos_after_ack == 1 && !timeout) {
-				scoped_lock lock{receive_mutex};
-				received_packages.back().halsband += 100 * int(data - '0');
-			}
-			else if (pos_after_ack == 2 && !timeout) {
-				scoped_lock lock{receive_mutex};
-				received_packages.back().halsband += 10 * int(data - '0');
+	// Decodes all bytes recieved since the last call into received_packages,
+	// the bytes are timestamped by the uart rx interrupt.
+	// A package is pushed for every 0x6, its halsband is only set once the whole
+	// answer 0x6 n2 n1 n0 0x4 x was recieved without error, so a lone ack has halsband 0
+	void decode_received() {
+		for (typename uart_t::rx_byte b; uart_t::Default().pop(b);) {
+			_decode_gap(b.time);
+			decode_last_time = b.time;
+			_decode_byte(b);
+		}
+		_decode_gap(time_us_64());
+	}
+	/*INTERNAL*/ void _decode_byte(const typename uart_t::rx_byte &b) {
+		auto &stats = bus_stats[decode_station];
+		switch (decode_state) {
+		case skip_frame:
+			if (b.data != 0x6)
+				return;
+			[[fallthrough]];
+		case expect_ack: 
+			if (b.data != 0x6)
+				break;
+			decode_station = b.time > cow_request_time ? request_station: prev_request_station;
+			if (b.time <= cow_request_time)
+				++bus_stats[decode_station].late_answers;
+			received_packages.push({.ack_time = b.time});
+			decode_state = expect_digit;
+			decode_digits = decode_halsband = 0;
+			return;
+		case expect_digit:
+			if (b.data == 0x6 && decode_digits == 0) { // lone ack followed by the next frame
+				++stats.good_frames;
+				decode_state = expect_ack;
+				_decode_byte(b);
+				return;
 			}
-			else if (pos_after_ack == 3 && !timeout) {
-				scoped_lock lock{receive_mutex};
-				received_packages.back().halsband += int(data - '0');
+			if (b.data < '0' || b.data > '9')
+				break;
+			decode_halsband = decode_halsband * 10 + (b.data - '0');
+			if (++decode_digits == 3)
+				decode_state = expect_terminator;
+			return;
+		case expect_terminator:
+			if (b.data != 0x4)
+				break;
+			decode_state = expect_trailer;
+			return;
+		case expect_trailer:
+			received_packages.back().halsband = decode_halsband;
+			++stats.good_frames;
+			decode_state = expect_ack;
+			return;
+		}
+		// malformed frame, a 0x6 might start the next one
+		++stats.framing_errors;
+		decode_state = skip_frame;
+		if (b.data == 0x6)
+			_decode_byte(b);
+	}
+	/*INTERNAL*/ void _decode_gap(uint64_t time) {
+		if (decode_state == expect_ack || time - decode_last_time <= MAX_BYTE_GAP_US)
+			return;
+		if (decode_state == expect_digit && decode_digits == 0)
+			++bus_stats[decode_station].good_frames; // lone ack
+		else if (decode_state != skip_frame)
+			++bus_stats[decode_station].framing_errors; // truncated frame
+		decode_state = expect_ack;
+	}
+
+	/** @brief appends the bus statistics of all stations of the bus as comma separated json objects to the static string s,
+	  * if first is false a comma is written before the first object */
+	template<int N>
+	int dump_bus_stats_json(static_string<N> &s, bool first = true) const {
+		int write_size{};
+		for (int i = 0; i < MAX_STATIONS; ++i) {
+			const auto &b = bus_stats[i];
+			write_size += s.append_formatted(R"({}{{"station":{},"good_frames":{},"framing_errors":{},"timeouts":{},"late_answers":{}}})",
+				first && i == 0 ? "": ",", STATION_OFFSET + i, b.good_frames, b.framing_errors, b.timeouts, b.late_answers);
+		}
+		return write_size;
+	}
+	/** @brief appends the frame jitter of the bus as json object to the static string s, see dump_bus_stats_json() for first */
+	template<int N>
+	int dump_jitter_json(static_string<N> &s, bool first = true) const {
+		int write_size = s.append_formatted(R"({}{{"station_offset":{},"hw_timer":{},"jitter":)", first ? "": ",", STATION_OFFSET, hw_timer);
+		write_size += uart_t::Default().tx_jitter.dump_to_json(s);
+		return write_size + s.append_formatted("}}");
+	}
+	/** @brief prints the bus statistics of all stations formatted for monospace output, eg. usb */
+	void print_bus_stats(std::ostream &os) const {
+		for (int i = 0; i < MAX_STATIONS; ++i)
+			os << "station " << STATION_OFFSET + i << ": " << bus_stats[i];
+		os << "frame jitter (hw_timer " << hw_timer << "): " << uart_t::Default().tx_jitter;
+	}
+
+	// Returns the station to poll next. Stations with a cow or with rations in flight are polled every turn,
+	// empty ones back off exponentially but are never skipped more than (1 << MAX_BACKOFF) - 1 turns
+	int next_station() {
+		bool rations_pending{};
+		{
+			auto &rations = rations_in_flight<>::Default();
+			scoped_lock lock{rations.rations_mutex}; // the table is shared with the other buses
+			rations_pending = rations.halsband_rationen.size();
+		}
+		for (int s = (cur_station + 1) % MAX_STATIONS;; s = (s + 1) % MAX_STATIONS) {
+			int backoff = std::min(station_idle_polls[s] / IDLE_POLLS_PER_BACKOFF, MAX_BACKOFF);
+			if (station_cur_cow[s] != 0)
+				backoff = 0;
+			else if (rations_pending)
+				backoff = std::min(backoff, 1); // the cow might come back to any station
+			if (station_skipped[s] >= (1 << backoff) - 1) {
+				station_skipped[s] = 0;
+				return s;
 			}
-				
-			++pos_after_ack;
+			++station_skipped[s];
 		}
 	}
 
@@ -112,48 +325,120 @@ struct kraftfutterstation {
 	// Is internally based on a simply state machine
 	// Transits a bunch of packages and returns the required time to wait
 	// until the next message shall be sent 
-	// (do a vTaskDelay(amount_of_time) after the call)
+	// (do a ulTaskNotifyTake(pdTRUE, amount_of_time) after the call, in the pipelined
+	// profile the wait ends early when the awaited station answer was completely recieved)
+	// With station_timing::hw_timer the returned wait ends TIMED_LEAD_US before the next frame is due,
+	// the frame is then handed to uart_connection::puts_at() and started by a hardware alarm at frame_time
 	int handle_station_communication() {
 		uint64_t time_start = time_us_64();
-		const auto get_wait_time = [time_start](uint32_t timeout){ return int((time_start + timeout - time_us_64()) / 1000); };
+		const auto &timing = station_timing::Default();
+		auto &uart = uart_t::Default();
+		if (hw_timer != timing.hw_timer) {
+			hw_timer = timing.hw_timer;
+			uart.tx_jitter = {};
+			frame_time = time_start;
+		}
+		// start of the frame sent in this step, a late frame goes out right away and delays the following ones
+		const uint64_t sent = hw_timer ? std::max(frame_time, time_start): time_start;
+		const auto send = [this, &uart, time_start](std::string_view frame) {
+			if (hw_timer)
+				return uart.puts_at(frame_time, frame);
+			if (frame_time)
+				uart.tx_jitter.add(int64_t(time_start - frame_time));
+			uart.puts(frame);
+		};
+		// schedules the next frame at t and returns the ms to wait for it
+		const auto next_frame_at = [this](uint64_t t) {
+			frame_time = t;
+			uint64_t now = time_us_64();
+			if (hw_timer)
+				return t > now + TIMED_LEAD_US ? int((t - now - TIMED_LEAD_US) / 1000): 0;
+			return t > now ? int((t - now + 999) / 1000): 0;
+		};
+		// pipelined: frames without answer only wait until they are sent plus the gap, frames with answer are
+		// ended early by the rx interrupt. Fixed: every frame waits its full timeout
+		const auto frame_wait_time = [this, &timing, sent, &next_frame_at](station_timing::frame f, std::string_view frame) {
+			if (f == station_timing::p2 || f == station_timing::feed) {
+				frame_time = sent + timing.frame_timeouts_us[f];
+				uint64_t now = time_us_64();
+				return frame_time > now ? int((frame_time - now) / 1000): 0;
+			}
+			if (!timing.pipelined)
+				return next_frame_at(sent + timing.frame_timeouts_us[f]);
+			// both puts variants return right away, the frame ends its length in chars after it was started
+			uint64_t end = sent + frame.size() * uart_t::CHAR_TIME_US;
+			return next_frame_at(end + timing.frame_gap_us);
+		};
+		// the frame after an answer follows its last byte (or its timeout) by wait_us
+		const auto after_answer = [this, &timing, time_start, &next_frame_at](bool answered, uint64_t wait_us) {
+			uint64_t end = !hw_timer ? time_start: answered && timing.pipelined ? decode_last_time: frame_time;
+			return next_frame_at(end + wait_us);
+		};
+		const uint64_t answer_gap_us = timing.pipelined ? timing.frame_gap_us: 0;
+		const int answer_size = timing.pipelined ? ANSWER_SIZE: 0;
+		const int feed_ack_size = timing.pipelined ? 1: 0; // the feed is acked with a lone 0x6
 		switch (state) {
 		case send_req_p0:
-			uart_futterstationen::Default().puts(messages::req_p0.message);
+			send(messages::req_p0);
 			state = send_req_p1;
-			return get_wait_time(messages::req_p0.timeout);
+			return frame_wait_time(station_timing::p0, messages::req_p0);
 		case send_req_p1:
-			uart_futterstationen::Default().puts(messages::req_p1.message);
+			send(messages::req_p1);
 			state = send_req_p2;
-			return get_wait_time(messages::req_p1.timeout);
+			return frame_wait_time(station_timing::p1, messages::req_p1);
 		case send_req_p2:
-			send_buffer.fill(messages::req_p2.message);
+			send_buffer.fill(messages::req_p2);
 			send_buffer[0] = '@' + cur_station;
-			uart_futterstationen::Default().puts(send_buffer.sv());
-			cow_request_time = time_start;
+			uart.expect_frame(0x6, answer_size);
+			send(send_buffer.sv());
+			prev_request_station = std::exchange(request_station, cur_station);
+			cow_request_time = sent;
 			state = await_ack_cow;
-			return get_wait_time(messages::req_p2.timeout);
+			return frame_wait_time(station_timing::p2, send_buffer.sv());
 		case await_ack_cow: {
-			scoped_lock lock{receive_mutex};
+			uart.expect_frame(0x6, 0);
+			decode_received();
 			const auto &p = received_packages.back();
+			if (p.ack_time <= cow_request_time)
+				++bus_stats[cur_station].timeouts;
 			bool cow_in_station = p.ack_time > cow_request_time && p.halsband != 0;
-			halsband_ration *entry = cow_in_station && time_start - station_last_feeds[cur_station] > settings::Default().dispense_timeout * 1e6
-				? halsband_rationen | find{p.halsband, &halsband_ration::halsband} : nullptr;
+			auto &rations = rations_in_flight<>::Default();
+			bool has_rations{};
+			if (cow_in_station && time_start - station_last_feeds[cur_station] > settings::Default().dispense_timeout * 1e6) {
+				scoped_lock lock{rations.rations_mutex};
+				has_rations = rations.halsband_rationen | find{p.halsband, &halsband_ration::halsband};
+			}
 
 			if (cow_in_station) {
+				if (station_idle_polls[cur_station] || (!station_arrival[cur_station] && station_cur_cow[cur_station] != p.halsband))
+					station_arrival[cur_station] = time_start;
 				station_cur_cow[cur_station] = p.halsband;
-				LogInfo("Cow {} in station {}", p.halsband, cur_station);
-			}
-			if (cow_in_station && !entry) {
-				// try fetch new ration
-				float amount = kuhspeicher::Default().feed_cow(p.halsband, cur_station);
-				if (amount > (1.f / RATIONS_PER_KG) && (entry = halsband_rationen.push())) {
+				station_idle_polls[cur_station] = 0;
+				LogInfo("Cow {} in station {}", p.halsband, STATION_OFFSET + cur_station);
+			} else if (station_idle_polls[cur_station] < std::numeric_limits<uint8_t>::max())
+				++station_idle_polls[cur_station];
+			if (cow_in_station && !has_rations) {
+				// try fetch new ration, feed_cow() does flash io and is called without the rations lock blocking the other buses
+				const uint32_t fetch_minute = ntp_client::Default().get_time_since_epoch() / 60;
+				float amount = kuhspeicher::Default().feed_cow(p.halsband, STATION_OFFSET + cur_station);
+				scoped_lock lock{rations.rations_mutex};
+				halsband_ration *entry = amount > (1.f / RATIONS_PER_KG) ? rations.halsband_rationen.push(): nullptr;
+				if (entry) {
 					entry->halsband = p.halsband;
 					entry->rations_count = amount * RATIONS_PER_KG;
+					entry->fetch_time = time_start;
+					entry->fetch_minute = fetch_minute;
+					rations.store();
+					measurements::Default().add_rations_in_flight(rations.halsband_rationen.size());
 					LogInfo("Cow {} now has {} rations", p.halsband, entry->rations_count);
-				} else
+					has_rations = true;
+				} else {
+					if (amount > (1.f / RATIONS_PER_KG))
+						++measurements::Default().rations_in_flight_full;
 					LogError("Cow with halsband {} could not be fed, kg: {}", p.halsband, amount);
+				}
 			}
-			if (entry) {
+			if (has_rations) {
 				// dispense previously fetched rations
 				state = send_req_feed;
 			} 
@@ -161,41 +446,75 @@ struct kraftfutterstation {
 				station_cur_cow[cur_station] = 0;
 				state = send_req_p3;
 			}
-			return 0;
+			return after_answer(p.ack_time > cow_request_time, answer_gap_us);
 		}
 		case send_req_feed:
-			send_buffer.fill(messages::req_feed.message);
+			send_buffer.fill(messages::req_feed);
 			send_buffer[0] = '@' + cur_station;
-			uart_futterstationen::Default().puts(send_buffer.sv());
-			cow_request_time = time_start;
+			uart.expect_frame(0x6, feed_ack_size);
+			send(send_buffer.sv());
+			prev_request_station = std::exchange(request_station, cur_station);
+			cow_request_time = sent;
 			state = await_ack_feed;
-			return get_wait_time(messages::req_feed.timeout);
+			return frame_wait_time(station_timing::feed, send_buffer.sv());
 		case await_ack_feed: {
-			scoped_lock lock{receive_mutex};
+			uart.expect_frame(0x6, 0);
+			decode_received();
 			const auto &p = received_packages.back();
-			halsband_ration *entry = p.ack_time > cow_request_time 
-				? halsband_rationen | find{p.halsband, &halsband_ration::halsband}: nullptr;
+			if (p.ack_time <= cow_request_time)
+				++bus_stats[cur_station].timeouts;
+			// the feed is acked with a lone 0x6, the cow is the one found in the station by the p2 request before
+			const int halsband = station_cur_cow[cur_station];
+			auto &rations = rations_in_flight<>::Default();
+			scoped_lock lock{rations.rations_mutex};
+			halsband_ration *entry = p.ack_time > cow_request_time && halsband
+				? rations.halsband_rationen | find{halsband, &halsband_ration::halsband}: nullptr;
 			// only remove the cow if the feed was successfull
 			if (entry) {
-				LogInfo("Feeding a ration {} in station {}", p.halsband, cur_station);
+				LogInfo("Feeding a ration {} in station {}", halsband, STATION_OFFSET + cur_station);
 				entry->rations_count -= 1;
-				if (entry->rations_count <= 0)
-					halsband_rationen.remove(entry - halsband_rationen.begin());
+				++measurements::Default().rations_dispensed;
+				bool rations_left = entry->rations_count > 0;
+				if (!rations_left) {
+					measurements::Default().add_ration_wait(uint32_t((time_start - entry->fetch_time) / 1000));
+					rations.halsband_rationen.remove(entry - rations.halsband_rationen.begin());
+				}
+				rations.store();
 				station_last_feeds[cur_station] = time_start;
+				if (station_arrival[cur_station]) {
+					measurements::Default().add_arrival_to_ration(uint32_t((time_start - station_arrival[cur_station]) / 1000));
+					station_arrival[cur_station] = 0;
+				}
+				// more rations left: stay in the slot and recheck the cow with p2 once the dispenser is ready again if
+				// that is soon, else the next ration is given in a later turn (see the dispense_timeout check in await_ack_cow)
+				const uint64_t dispense_wait_us = uint64_t(settings::Default().dispense_timeout * 1e6) + 1000;
+				if (rations_left && ++slot_feeds < timing.feeds_per_slot && dispense_wait_us <= MAX_SLOT_WAIT_US) {
+					state = send_req_p2;
+					return after_answer(true, std::max(answer_gap_us, dispense_wait_us));
+				}
 			}
 			state = send_req_p3;
-			return 0;
+			return after_answer(p.ack_time > cow_request_time, answer_gap_us);
 		}
 		case send_req_p3:
-			if (cur_station & 1)
-				uart_futterstationen::Default().puts(messages::req_p3_1.message);
-			else
-				uart_futterstationen::Default().puts(messages::req_p3_0.message);
-			cur_station = (cur_station + 1) % MAX_STATIONS;
+			send_buffer.fill(cur_station & 1 ? messages::req_p3_1: messages::req_p3_0);
+			cur_station = next_station();
+			slot_feeds = 0;
 			state = send_req_p0;
-			return get_wait_time(messages::req_p3_0.timeout);
+			if (timing.pipelined && timing.frame_gap_us == 0) {
+				// stations need no gap, p0 of the next cycle directly follows p3
+				send_buffer.append(messages::req_p0);
+				send(send_buffer.sv());
+				state = send_req_p1;
+				return frame_wait_time(station_timing::p0, send_buffer.sv());
+			}
+			send(send_buffer.sv());
+			return frame_wait_time(station_timing::p3, send_buffer.sv());
 		default: state = send_req_p0; return 0;
 		}
 	}
 };
 
+
+using futterstationen_bus_0 = kraftfutterstation<>;
+using futterstationen_bus_1 = kraftfutterstation<uart_futterstationen_1, 4, futterstationen_bus_0::stations>;
@@ -3,19 +3,25 @@
 #include "static_types.h"
 #include "persistent_storage.h"
 #include "ranges"
+#include <bit>
 #include "ntp_client.h"
 #include "settings.h"
+#include "ration_window.h"
+#include "task.h"
 
 #define LOG_ASSERT(x, msg) if (!x) LogError(msg);
 
-constexpr time_t A_DAY = 24 * 60;
-
 enum struct problem: uint8_t {
 	NOT_FED_SINCE_12_HOURS = 0,
 	NOT_FED_SINCE_24_HOURS,
 	NOT_FED_SINCE_48_HOURS,
 	NEVER_FED,
 };
+enum struct import_start: uint8_t {
+	STARTED = 0,
+	RUNNING, // another import is not finished yet
+	STORAGE_BUSY, // the storage journal is compacted first, retry shortly
+};
 constexpr std::string_view to_string(problem p) {
 	switch (p) {
 		case problem::NOT_FED_SINCE_12_HOURS: return "Kuh hat seit 12 Stunden kein Kraftfutter";
@@ -28,8 +34,10 @@ constexpr std::string_view to_string(problem p) {
 
 struct kuhspeicher {
 	using iota = std::ranges::iota_view<size_t, size_t>;
+	using cows_view_t = persistent_storage_t::array_view<kuh>;
 	static kuhspeicher& Default() {
 		static kuhspeicher speicher{};
+		[[maybe_unused]] static bool inited = [](){ speicher.rebuild_index(); return true; }();
 		return speicher;
 	}
 
@@ -39,78 +47,237 @@ struct kuhspeicher {
 	struct problematic_cow { uint8_t cow_idx{}; problem prob{};};
 	static_vector<problematic_cow, 256, uint8_t> problematic_cows{};
 	bool request_problematic_cow_update{true};
+	struct problem_deadline { uint32_t deadline{}; uint8_t cow_idx{}; };
+	static_vector<problem_deadline, 2 * MAX_COWS> problem_deadlines{}; // min heap of the next threshold crossings
+	std::array<uint32_t, MAX_COWS> cow_deadlines{}; // valid deadline per cow, 0 if none, older heap entries are skipped
+	time_t next_problem_deadline{};
+	struct window_feeds { uint32_t window_start{}; uint8_t count{}; };
+	std::array<window_feeds, MAX_COWS> cow_window_feeds{}; // feeds in the current ration window, reset lazily
+	TaskHandle_t problematic_cows_task{};
+	mutex problematic_mutex{};
+	static_hash_map<int, uint8_t, 2 * MAX_COWS> halsband_index{}; // halsbandnr -> cow idx, ram copy to avoid flash scans
+	static_hash_map<uint32_t, uint8_t, 2 * MAX_COWS> name_index{}; // fnv1a(name) -> cow idx
+	bool name_index_collision{}; // if two names share a hash lookups fall back to a linear scan
+	static_string<2048> import_line{}; // incomplete ndjson line of a running herd import
+	bool import_active{};
+	bool import_line_overflow{}; // skip the rest of a too long line
+	int import_count{};
+	int import_errors{};
 
 	int cows_size() const { return std::clamp(persistent_storage_t::Default().view(&persistent_storage_layout::cows_size), 0, MAX_COWS); }
-	std::span<kuh> cows_view() const { return persistent_storage_t::Default().view(&persistent_storage_layout::cows, 0, cows_size()); }
+	cows_view_t cows_view() const { return persistent_storage_t::Default().view(&persistent_storage_layout::cows, 0, cows_size()); }
+
+	/** @brief Collects all following cow modifications in ram until commit(), which writes each touched flash sector once.
+	  * To be used for bulk operations, a batch costs a journal compaction at its begin if the journal holds records */
+	void begin_batch() {
+		if (PICO_OK != persistent_storage_t::Default().begin_batch())
+			LogError("Failed to begin cow batch");
+	}
+	bool commit() {
+		err_t res = persistent_storage_t::Default().commit();
+		if (res != PICO_OK)
+			LogError("Failed to commit cow batch: {}", res);
+		return res == PICO_OK;
+	}
 
 	void clear() {
 		LogInfo("Clearing cows");
-		request_problematic_cow_update = true;
+		request_problematic_cows_rebuild();
+		halsband_index.clear();
+		name_index.clear();
+		name_index_collision = false;
 		persistent_storage_t::Default().write(0, &persistent_storage_layout::cows_size);
 	}
 
+	/** @brief rebuilds all ram indices from the flash cow storage, done once at startup */
+	void rebuild_index() {
+		halsband_index.clear();
+		name_index.clear();
+		name_index_collision = false;
+		cows_view_t cows = cows_view();
+		for (int i: iota{0, cows.size()})
+			_index_insert(cows[i], i);
+	}
+	/** @returns the index of the cow with the given necklace number, -1 if not found */
+	int find_cow_by_halsband(int halsbandnr) const {
+		const uint8_t *idx = halsband_index.find(halsbandnr);
+		return idx ? int(*idx): -1;
+	}
+	/** @brief true if the newest stored feed of the cow with the halsband is at or after minute */
+	bool has_feed_since(int halsbandnr, uint32_t minute) const {
+		int idx = find_cow_by_halsband(halsbandnr);
+		if (idx < 0)
+			return false;
+		const kuh c = cows_view()[idx];
+		const auto &f = c.letzte_fuetterungen;
+		return f.size() && f[f.size() - 1].timestamp >= minute;
+	}
+	/** @returns the index of the cow with the given name, -1 if not found */
+	int find_cow_by_name(std::string_view name) const {
+		cows_view_t cows = cows_view();
+		const uint8_t *idx = name_index.find(fnv1a(name));
+		if (idx && *idx < cows.size() && cows[*idx].name.sv() == name)
+			return *idx;
+		if (!name_index_collision)
+			return -1;
+		for (int i: iota{0, cows.size()})
+			if (cows[i].name.sv() == name)
+				return i;
+		return -1;
+	}
+
+	/** @brief Collects the newest feeds of all cows with a k-way merge. The feed ring of each cow is already
+	 * time ordered, so a max heap over the newest not yet taken feed of each cow yields the feeds newest first */
 	void reload_last_feeds() {
+		struct feed_tail { uint32_t timestamp{}; uint8_t cow_idx{}, pos{}; };
+		static static_vector<feed_tail, MAX_COWS> tails{}; // static to keep the startup task stack small
+		const auto older = [](const feed_tail &a, const feed_tail &b) { return a.timestamp < b.timestamp; };
 		last_feeds.clear();
-		std::span<kuh> cows = cows_view();
-		const auto last_feed_time = [&](last_feed f){ return cows[f.cow_idx].letzte_fuetterungen.storage[f.feed_idx].timestamp; };
-		for (int i: iota(0, cows.size())) {
-			for (int j: iota(0, cows[i].letzte_fuetterungen.size())) {
-				last_feed lf{uint8_t(i), uint8_t(j)};
-				if (last_feeds.full && last_feed_time(last_feeds[0]) > last_feed_time(lf))
-					continue;
-				last_feeds.push(lf);
-				// sort the stuff
-				for (int i = last_feeds.size() - 2, j = last_feeds.size() - 1;
-				     i >= 0; --i, --j) {
-					if (last_feed_time(last_feeds[i]) < last_feed_time(last_feeds[j]))
-						break;
-					std::swap(last_feeds[i], last_feeds[j]);
-				}
+		tails.clear();
+		cows_view_t cows = cows_view();
+		for (int i: iota{0, cows.size()}) {
+			const auto &f = cows[i].letzte_fuetterungen;
+			if (!f.empty())
+				tails.push({.timestamp = f.back().timestamp, .cow_idx = uint8_t(i), .pos = uint8_t(f.size() - 1)});
+		}
+		std::make_heap(tails.begin(), tails.end(), older);
+		std::array<last_feed, std::tuple_size_v<decltype(last_feeds.storage)>> newest;
+		int n{};
+		for (; n < int(newest.size()) && !tails.empty(); ++n) {
+			std::pop_heap(tails.begin(), tails.end(), older);
+			feed_tail &t = *(tails.end() - 1);
+			const auto &f = cows[t.cow_idx].letzte_fuetterungen;
+			newest[n] = last_feed{t.cow_idx, uint8_t((f.cur_start + t.pos) % f.storage.size())};
+			if (t.pos == 0) {
+				tails.remove(tails.size() - 1);
+				continue;
 			}
+			t.timestamp = f[--t.pos].timestamp;
+			std::push_heap(tails.begin(), tails.end(), older);
+		}
+		for (int i = n - 1; i >= 0; --i)
+			last_feeds.push(newest[i]);
+	}
+
+	/** @brief Updates the problematic cows incrementally. Only cows whose next threshold deadline
+	 * has passed are reevaluated, a full rebuild is only done if request_problematic_cow_update is set.
+	 * @returns the time in ms until the next threshold crossing */
+	int check_for_problematic_cows() {
+		scoped_lock lock{problematic_mutex};
+		time_t cur_mins = ntp_client::Default().get_time_since_epoch() / 60;
+		if (request_problematic_cow_update) {
+			request_problematic_cow_update = false;
+			problematic_cows.clear();
+			problem_deadlines.clear();
+			for (int i: iota{0, size_t(cows_size())})
+				_refresh_problematic_cow(i, cur_mins);
+		}
+		const auto later = [](const problem_deadline &a, const problem_deadline &b) { return a.deadline > b.deadline; };
+		while (problem_deadlines.size() && problem_deadlines[0].deadline <= cur_mins) {
+			std::pop_heap(problem_deadlines.begin(), problem_deadlines.end(), later);
+			problem_deadline d = *(problem_deadlines.end() - 1);
+			problem_deadlines.remove(problem_deadlines.size() - 1);
+			if (cow_deadlines[d.cow_idx] == d.deadline) // else outdated entry
+				_refresh_problematic_cow(d.cow_idx, cur_mins);
 		}
+		// sleeping at max an hour to catch up with larger time adjustments
+		next_problem_deadline = problem_deadlines.empty() ? cur_mins + 60: std::min<time_t>(problem_deadlines[0].deadline, cur_mins + 60);
+		return int(next_problem_deadline * 60 - ntp_client::Default().get_time_since_epoch()) * 1000;
 	}
 
-	void check_for_problematic_cows() {
-		if (!request_problematic_cow_update)
+	/** @brief Reevaluates a single cow after it was changed, notifies the problematic cows task if it has to wake up earlier */
+	void update_problematic_cow(int cow_idx) {
+		scoped_lock lock{problematic_mutex};
+		if (request_problematic_cow_update)
 			return;
-		request_problematic_cow_update = false;
-		// always rebuilds the problematic cows vector
-		problematic_cows.clear();
-		std::span<kuh> cows{cows_view()};
 		time_t cur_mins = ntp_client::Default().get_time_since_epoch() / 60;
-		for (const auto &cow: cows) {
-			if (cow.halsbandnr == 0)
-				continue;
-			uint8_t i = uint8_t(&cow - cows.data());
-			if (cow.letzte_fuetterungen.empty()) {
-				LOG_ASSERT(problematic_cows.push({.cow_idx = i, .prob = problem::NEVER_FED}),
-					   "Failed to add problematic cow never fed");
-				continue;
-			} 
-			float delta_hours = float(cur_mins - cow.letzte_fuetterungen.back().timestamp) / 60.f;
-			if (delta_hours >= 48.f) {
-				LOG_ASSERT(problematic_cows.push({.cow_idx = i, .prob = problem::NOT_FED_SINCE_48_HOURS}),
-					   "Failed to add problematic cow 48h");
-				continue;
-			}
-			if (delta_hours >= 24.f) {
-				LOG_ASSERT(problematic_cows.push({.cow_idx = i, .prob = problem::NOT_FED_SINCE_24_HOURS}),
-					   "Failed to add problematic cow 24h");
-				continue;
-			}
-			if (delta_hours >= 12.f) {
-				LOG_ASSERT(problematic_cows.push({.cow_idx = i, .prob = problem::NOT_FED_SINCE_12_HOURS}),
-					   "Failed to add problematic cow 12h");
-				continue;
-			}
+		_refresh_problematic_cow(cow_idx, cur_mins);
+		if (cow_deadlines[cow_idx] && cow_deadlines[cow_idx] < next_problem_deadline && problematic_cows_task)
+			xTaskNotifyGive(problematic_cows_task);
+	}
+
+	/** @brief Schedules a full rebuild of the problematic cows, needed if cow indices changed */
+	void request_problematic_cows_rebuild() {
+		request_problematic_cow_update = true;
+		if (problematic_cows_task)
+			xTaskNotifyGive(problematic_cows_task);
+	}
+
+	/** @brief writes the cow as json object in the format accepted by parse_cow_from_json()
+	  * @return amount of written bytes */
+	template<int N>
+	int print_cow_json(const kuh &c, static_string<N> &out) const {
+		int write_size = out.append_formatted(
+			R"({{"name":"{}","knr":{},"halsbandnr":{},"kraftfuttermenge":{},"abkalbungstag":{},"letzte_fuetterungen":[)", 
+			c.name.sv(), c.knr, c.halsbandnr, c.kraftfuttermenge, c.abkalbungstag);
+		bool first{true};
+		for (const auto &feed_entry: c.letzte_fuetterungen) {
+			write_size += out.append_formatted(R"({}"{}:{}")", first ? "": ",", feed_entry.station, feed_entry.timestamp);
+			first = false;
 		}
+		out.append("]}");
+		return write_size + 2;
+	}
+
+	/** @brief Starts a herd import of newline separated cow json objects (ndjson). All cows are written in
+	  * one batch, so every flash sector is written about once for the whole herd. The batch is only started
+	  * on an empty storage journal as the import runs in the lwIP callbacks, see begin_batch_if_ready() */
+	import_start import_begin() {
+		if (import_active)
+			return import_start::RUNNING;
+		if (!persistent_storage_t::Default().begin_batch_if_ready())
+			return import_start::STORAGE_BUSY;
+		import_active = true;
+		import_line.clear();
+		import_line_overflow = false;
+		import_count = import_errors = 0;
+		return import_start::STARTED;
+	}
+	/** @brief Adds the next part of the import data, lines can be split at any position between parts */
+	void import_chunk(std::string_view chunk) {
+		while (chunk.size()) {
+			size_t newline = chunk.find('\n');
+			std::string_view part = chunk.substr(0, newline);
+			if (import_line.size() + part.size() > import_line.storage.size())
+				import_line_overflow = true;
+			else
+				import_line.append(part);
+			if (newline == std::string_view::npos)
+				return;
+			_import_line();
+			chunk = chunk.substr(newline + 1);
+		}
+	}
+	/** @brief Imports the last line, which needs no newline, and commits the batch */
+	bool import_end() {
+		if (!import_active)
+			return false;
+		_import_line();
+		import_active = false;
+		bool res = commit();
+		reload_last_feeds();
+		LogInfo("Imported {} cows, {} failed", import_count, import_errors);
+		return res;
+	}
+	/** @brief Ends an import whose upload broke off, the unfinished line is discarded. The cows of the complete lines
+	  * can not be rolled back as the batch already wrote full sectors of them, they are committed so that no cow
+	  * is left half written. Uploading the herd again completes the import */
+	void import_abort() {
+		if (!import_active)
+			return;
+		import_line.clear();
+		import_line_overflow = false;
+		import_active = false;
+		commit();
+		reload_last_feeds();
+		LogWarning("Herd upload aborted, imported {} complete cows, {} failed", import_count, import_errors);
 	}
 
 	template<int N>
 	int print_last_feeds(static_string<N> &out) {
 		int write_size{2}; // 2 for opening and closing bracket
 		out.append('[');
-		std::span<kuh> cows{cows_view()};
+		cows_view_t cows{cows_view()};
 		for (auto c: last_feeds) {
 			const auto &cow = cows[c.cow_idx];
 			if (write_size > 2) {
@@ -125,70 +292,42 @@ struct kuhspeicher {
 		return write_size;
 	}
 
-	// returns the fed kilogram of kraftfutter, returns 0 if nothing was fed, -1 if cow was not found, -2 if time issues arose
+	// returns the fed kilogram of kraftfutter, returns 0 if nothing was fed, -1 if cow was not found
 	float feed_cow(int necklace_number, int station) {
-		const auto in_window = [](time_t s, time_t t, time_t e) {
-			if (e >= s) {
-				if (t < e)
-					t += A_DAY;
-				e += A_DAY;
-			}
-			return s <= t && t < e;
-		};
-
-		std::span<kuh> cows{cows_view()};
-		for (kuh &c: cows) {
-			if (c.halsbandnr != necklace_number)
-				continue;
-
-			LogInfo("Cow {} wanting some kraftfutter, s {}", c.name.sv(), c.letzte_fuetterungen.size());
+		cows_view_t cows{cows_view()};
+		int cow_idx = find_cow_by_halsband(necklace_number);
+		if (cow_idx < 0 || cow_idx >= int(cows.size())) {
+			LogError("Could not find cow with number {}", necklace_number);
+			return -1;
+		}
+		const kuh &c = cows[cow_idx];
+		LogInfo("Cow {} wanting some kraftfutter, s {}", c.name.sv(), c.letzte_fuetterungen.size());
 
-			cow = c; // copy over to ram memory
-			// calculating the minutes for ration start
-			time_t secs = ntp_client::Default().get_time_since_epoch();
-			struct tm* time = gmtime(&secs);
-			if (!time) {
-				LogError("Failed to convert seconds to tm");
-				return -2;
-			}
-			const auto &s = settings::Default();
-			int minute = time->tm_hour * 60 + time->tm_min;
-			int reset_minute = s.reset_offsets[std::max(s.reset_times - 1, 0)];
-			int reset_minute_after = s.reset_offsets[0];
-			for (int i = 0; i < s.reset_times - 1 && !in_window(reset_minute, minute, reset_minute_after) ; ++i) {
-				reset_minute = s.reset_offsets[i];
-				reset_minute_after = s.reset_offsets[(i + 1) % s.reset_times];
-			}
-			int res_del = reset_minute_after - reset_minute;
-			if (res_del <= 0)
-				res_del += A_DAY;
-			time->tm_hour = reset_minute / 60;
-			time->tm_min = reset_minute % 60;
-			time->tm_sec = 0;
-			time_t start_time = mktime(time) / 60;
-			time_t mins = secs / 60;
-			int expected_feeds = int((mins - start_time) / float(res_del) * float(s.rations)) + 1;
-			if (expected_feeds < 0) {
-				LogError("Expected feeds is negative");
-				return -2;
-			}
-			auto& f = cow.letzte_fuetterungen;
-			int feeds{};
-			for (int i = f.size() - 1; i >= 0 && f[i].timestamp >= start_time; --i)
-				++feeds;
-			if (feeds < expected_feeds) {
-				int cow_idx = &c - cows.data();
-				last_feeds.push(last_feed{uint8_t(cow_idx), uint8_t(f.cur_write)});
-				f.push(feed_entry{.station = uint8_t(station), .timestamp = uint32_t(mins)});
-				write_or_create_cow(cow, cow_idx);
-				return cow.kraftfuttermenge / s.rations;
-			} else {
-				LogInfo("Hungry cow wanted more but has all its rations already {}/{} s {}", feeds, expected_feeds, f.size());
-				return 0;
-			}
+		time_t mins = ntp_client::Default().get_time_since_epoch() / 60;
+		auto &window = ration_window::Default();
+		window.update(mins);
+		auto &feeds = cow_window_feeds[cow_idx];
+		if (feeds.window_start != window.start) {
+			// lazy reset, counts the feeds already in the window (only more than 0 after startup or settings change)
+			const auto &f = c.letzte_fuetterungen;
+			feeds = {.window_start = uint32_t(window.start)};
+			for (int i = f.size() - 1; i >= 0 && f[i].timestamp >= window.start; --i)
+				++feeds.count;
 		}
-		LogError("Could not find cow with number {}", necklace_number);
-		return -1;
+		int expected_feeds = window.expected_feeds(mins);
+		if (feeds.count >= expected_feeds) {
+			LogInfo("Hungry cow wanted more but has all its rations already {}/{} s {}", feeds.count, expected_feeds, c.letzte_fuetterungen.size());
+			return 0;
+		}
+
+		cow = c; // copy over to ram memory
+		auto& f = cow.letzte_fuetterungen;
+		last_feeds.push(last_feed{uint8_t(cow_idx), uint8_t(f.cur_write)});
+		f.push(feed_entry{.station = uint8_t(station), .timestamp = uint32_t(mins)});
+		window_feeds fed{.window_start = feeds.window_start, .count = uint8_t(feeds.count + 1)};
+		write_or_create_cow(cow, cow_idx);
+		cow_window_feeds[cow_idx] = fed;
+		return cow.kraftfuttermenge / settings::Default().rations;
 	}
 
 	bool write_or_create_cow(const kuh &cow, int dst = -1) {
@@ -197,14 +336,8 @@ struct kuhspeicher {
 			return false;
 		}
 		auto cows_span = cows_view();
-		for (int i: iota{0, cows_span.size()}) {
-			if (dst != -1)
-				break;
-			if (cows_span[i].name.sv() == cow.name.sv()) {
-				dst = i;
-				break;
-			}
-		}
+		if (dst == -1)
+			dst = find_cow_by_name(cow.name.sv());
 		if (dst < 0) {
 			int s = cows_span.size();
 			if (s == MAX_COWS)
@@ -212,58 +345,110 @@ struct kuhspeicher {
 			persistent_storage_t::Default().write(s + 1, &persistent_storage_layout::cows_size);
 			dst = s;
 		}
+		int prev_halsband{};
+		if (dst < int(cows_span.size())) {
+			prev_halsband = cows_span[dst].halsbandnr;
+			_index_erase(cows_span[dst], dst);
+		}
 		err_t res = persistent_storage_t::Default().write_array_range(&cow, &persistent_storage_layout::cows, dst, dst + 1);
-		request_problematic_cow_update = true;
+		_index_insert(cow, dst);
+		_index_repair_halsband(prev_halsband);
+		update_problematic_cow(dst);
 		LogInfo("Cow {} written with result: {}", cow.name.sv(), res);
 		return true;
 	}
 
-	void delete_cow(int i, std::span<kuh> cows) {
+	void delete_cow(int i, cows_view_t cows) {
 		if (cows.empty())
 			return;
-		if (size_t(i) != cows.size() - 1)
-			persistent_storage_t::Default().write_array_range(&cows.back(), &persistent_storage_layout::cows, i, i + 1);
-		else
-			persistent_storage_t::Default().write(cows.size() - 1, &persistent_storage_layout::cows_size);
-		request_problematic_cow_update = true;
+		int last = cows.size() - 1;
+		const int halsband = cows[i].halsbandnr;
+		_index_erase(cows[i], i);
+		if (i != last) {
+			kuh moved = cows[last];
+			_index_erase(moved, last);
+			persistent_storage_t::Default().write_array_range(&moved, &persistent_storage_layout::cows, i, i + 1);
+			_index_insert(moved, i);
+		}
+		persistent_storage_t::Default().write(last, &persistent_storage_layout::cows_size);
+		_index_repair_halsband(halsband);
+		request_problematic_cows_rebuild();
 	}
 
 	bool delete_cow(std::string_view name) {
-		auto cows = cows_view();
-		int dst{-1};
-		for (int i: iota{0, cows.size()}) {
-			if (cows[i].name.sv() == name) {
-				dst = i;
-				break;
-			}
-		}
+		int dst = find_cow_by_name(name);
 		if (dst < 0) {
 			LogError("Failed to find cow {}", name);
 			return false;
 		}
-		delete_cow(dst, cows);
+		delete_cow(dst, cows_view());
 		return true;
 	}
 
 	void set_cow_kraftfutter(std::string_view cow_name, float kraftfutter) {
-		std::span<kuh> cows{cows_view()};
-		for (int i: iota{0, cows.size()}) {
-			const auto &c = cows[i];
-			if (c.name.sv() != cow_name)
-				continue;
-			cow = c;
-			cow.kraftfuttermenge = kraftfutter;
-			write_or_create_cow(cow, i);
+		int i = find_cow_by_name(cow_name);
+		if (i < 0) {
+			LogError("Could not find the cow to set kraftfutter");
+			return;
+		}
+		cow = cows_view()[i];
+		cow.kraftfuttermenge = kraftfutter;
+		write_or_create_cow(cow, i);
+	}
+
+	/** @brief converts the data stored by an older firmware to the current LAYOUT_VERSION.
+	  * Anything else than a known version (also erased flash) counts as version 1.
+	  * Every step can be repeated: only cows still in the old format are converted, a few at a time, and the
+	  * members added later are written with fixed defaults, so a reset during the migration simply continues
+	  * it on the next boot. The version is written last */
+	void migrate_storage() {
+		constexpr int CHUNK_COWS{FLASH_SECTOR_SIZE / sizeof(kuh)};
+		auto &storage = persistent_storage_t::Default();
+		uint32_t version = storage.view(&persistent_storage_layout::layout_version);
+		if (version == LAYOUT_VERSION)
 			return;
+		if (version != 2)
+			version = 1;
+		LogInfo("Migrating storage from version {} to {}", version, LAYOUT_VERSION);
+		// version 1 -> 2
+		for (int chunk = 0; version < 2 && chunk < cows_size(); chunk += CHUNK_COWS) {
+			begin_batch();
+			for (int i = chunk; i < std::min(chunk + CHUNK_COWS, cows_size()); ++i) {
+				kuh c = cows_view()[i];
+				if (!_feeds_in_v1_format(c))
+					continue;
+				// version 1 had the station in the lowest 2 bits followed by the timestamp
+				for (feed_entry &e: c.letzte_fuetterungen.storage) {
+					uint32_t raw = std::bit_cast<uint32_t>(e);
+					e = feed_entry{.station = uint8_t(raw & 0x3), .timestamp = raw >> 2};
+				}
+				storage.write_array_range(&c, &persistent_storage_layout::cows, i, i + 1);
+			}
+			commit();
 		}
-		LogError("Could not find the cow to set kraftfutter");
+		// version 2 -> 3: the rest of station_timing and the rations in flight moved in front of the version
+		storage.write(station_slot_timing{}, &persistent_storage_layout::station_slot_timings);
+		storage.write(decltype(persistent_storage_layout::reserved){}, &persistent_storage_layout::reserved);
+		storage.write(LAYOUT_VERSION, &persistent_storage_layout::layout_version);
+		storage.flush();
 	}
 
+	/** @brief deletes cows with a broken name (eg. erased flash), only opens a batch if there is any */
 	void sanitize_cows() {
-		auto cows = cows_view();
-		for (int i: iota{0, cows.size()})
-			if (cows[i].name.size() > cows[i].name.storage.size())
-				delete_cow(i, cows);
+		bool batch{};
+		// backwards as delete_cow() moves the last cow into the freed slot
+		for (int i = cows_size() - 1; i >= 0; --i) {
+			auto cows = cows_view();
+			auto name = cows[i].name;
+			if (name.size() <= name.storage.size())
+				continue;
+			if (!batch)
+				begin_batch();
+			batch = true;
+			delete_cow(i, cows);
+		}
+		if (batch)
+			commit();
 	}
 
 	kuh* parse_cow_from_json(std::string_view json) {
@@ -295,6 +480,28 @@ struct kuhspeicher {
 				auto abkalbungstag = parse_remove_json_double(json);
 				JSON_ASSERT(abkalbungstag, "Failed parsing abkalbungstag");
 				cow.abkalbungstag = abkalbungstag.value();
+			} else if (key == "letzte_fuetterungen") {
+				// array of "station:timestamp" strings, oldest first
+				skip_whitespace(json);
+				JSON_ASSERT(json.size() && json[0] == '[', "Invalid json, missing '[' for letzte_fuetterungen");
+				json = json.substr(1);
+				skip_whitespace(json);
+				while (json.size() && json[0] != ']') {
+					auto feed = parse_remove_json_string(json);
+					JSON_ASSERT(feed, "Failed parsing feed entry");
+					char *end{};
+					uint32_t station = strtoul(feed.value().data(), &end, 10);
+					JSON_ASSERT(end < feed->data() + feed->size() && *end == ':', "Invalid feed entry, missing ':'");
+					JSON_ASSERT(station <= MAX_STATION_ID, "Invalid feed entry, station too large");
+					cow.letzte_fuetterungen.push(feed_entry{.station = uint8_t(station), .timestamp = uint32_t(strtoul(end + 1, nullptr, 10))});
+					if (json.size() && json[0] == ',') {
+						json = json.substr(1);
+						skip_whitespace(json);
+					}
+				}
+				JSON_ASSERT(json.size(), "Invalid json, missing ']' for letzte_fuetterungen");
+				json = json.substr(1);
+				skip_whitespace(json);
 			} else {
 				LogError("Invalid key {}", key.value());
 				return {};
@@ -313,6 +520,111 @@ struct kuhspeicher {
 		JSON_ASSERT(cow.abkalbungstag != 0, "Abkalbungstag is 0");
 		return &cow;
 	}
+
+	/*INTERNAL*/ void _import_line() {
+		std::string_view line = import_line.sv();
+		while (line.size() && (line.back() == '\r' || line.back() == ' '))
+			line.remove_suffix(1);
+		if (import_line_overflow) {
+			LogError("Import line too long, skipping cow");
+			++import_errors;
+		} else if (line.size() && line.back() != '}') {
+			LogError("Import line not terminated, skipping cow");
+			++import_errors;
+		} else if (line.size()) {
+			kuh *c = parse_cow_from_json(line);
+			if (c && write_or_create_cow(*c))
+				++import_count;
+			else
+				++import_errors;
+		}
+		import_line.clear();
+		import_line_overflow = false;
+	}
+	/*INTERNAL*/ void _refresh_problematic_cow(int cow_idx, time_t cur_mins) {
+		static constexpr std::array<time_t, 3> thresholds{A_DAY / 2, A_DAY, 2 * A_DAY};
+		problematic_cows.remove_if([cow_idx](const problematic_cow &p) { return p.cow_idx == cow_idx; });
+		cow_deadlines[cow_idx] = 0;
+		const kuh &cow = cows_view()[cow_idx];
+		if (cow.halsbandnr == 0)
+			return;
+		if (cow.letzte_fuetterungen.empty()) {
+			LOG_ASSERT(problematic_cows.push({.cow_idx = uint8_t(cow_idx), .prob = problem::NEVER_FED}),
+				   "Failed to add problematic cow never fed");
+			return;
+		}
+		time_t last_feed = cow.letzte_fuetterungen.back().timestamp;
+		int level{-1};
+		for (time_t t: thresholds) {
+			if (cur_mins < last_feed + t) {
+				cow_deadlines[cow_idx] = uint32_t(last_feed + t);
+				break;
+			}
+			++level;
+		}
+		if (level >= 0) {
+			LOG_ASSERT(problematic_cows.push({.cow_idx = uint8_t(cow_idx), .prob = problem(level)}),
+				   "Failed to add problematic cow");
+		}
+		if (!cow_deadlines[cow_idx])
+			return;
+		const auto later = [](const problem_deadline &a, const problem_deadline &b) { return a.deadline > b.deadline; };
+		if (problem_deadlines.size() == int(problem_deadlines.storage.size())) {
+			// every feed leaves an outdated entry behind, drop them all at once
+			problem_deadlines.remove_if([this](const problem_deadline &d) { return cow_deadlines[d.cow_idx] != d.deadline; });
+			std::make_heap(problem_deadlines.begin(), problem_deadlines.end(), later);
+		}
+		if (!problem_deadlines.push({.deadline = cow_deadlines[cow_idx], .cow_idx = uint8_t(cow_idx)})) {
+			request_problematic_cows_rebuild();
+			return;
+		}
+		std::push_heap(problem_deadlines.begin(), problem_deadlines.end(), later);
+	}
+	/** @brief true if the feeds are still in the layout version 1 format (2 bit station, 30 bit timestamp),
+	  * read in the current format their newest timestamp then lies before 2020 */
+	/*INTERNAL*/ static bool _feeds_in_v1_format(const kuh &c) {
+		constexpr uint32_t MINUTES_2020{26297280};
+		return !c.letzte_fuetterungen.empty() && c.letzte_fuetterungen.back().timestamp < MINUTES_2020;
+	}
+	/*INTERNAL*/ void _index_insert(const kuh &c, int idx) {
+		cow_window_feeds[idx] = {};
+		uint32_t name_hash = fnv1a(c.name.sv());
+		const uint8_t *prev_name = name_index.find(name_hash);
+		if (prev_name && *prev_name != idx && *prev_name < cows_size()) {
+			// keep the old entry, the colliding cow is found via linear scan
+			name_index_collision = true;
+		} else if (!name_index.insert(name_hash, uint8_t(idx)))
+			LogError("Name index full");
+		if (c.halsbandnr == 0)
+			return;
+		const uint8_t *prev = halsband_index.find(c.halsbandnr);
+		if (prev && *prev != idx)
+			LogWarning("Halsband {} used by multiple cows", c.halsbandnr);
+		if (!halsband_index.insert(c.halsbandnr, uint8_t(idx)))
+			LogError("Halsband index full");
+	}
+	/*INTERNAL*/ void _index_erase(const kuh &c, int idx) {
+		const uint8_t *cur_name = name_index.find(fnv1a(c.name.sv()));
+		if (cur_name && *cur_name == idx)
+			name_index.erase(fnv1a(c.name.sv()));
+		const uint8_t *cur = halsband_index.find(c.halsbandnr);
+		if (cur && *cur == idx)
+			halsband_index.erase(c.halsbandnr);
+	}
+	/** @brief after the indexed cow of a halsband was deleted or got another halsband, points the index to a
+	  * remaining cow with this halsband (only if several cows share it) */
+	/*INTERNAL*/ void _index_repair_halsband(int halsbandnr) {
+		if (halsbandnr == 0 || halsband_index.find(halsbandnr))
+			return;
+		cows_view_t cows = cows_view();
+		for (int i: iota{0, cows.size()}) {
+			if (cows[i].halsbandnr != halsbandnr)
+				continue;
+			if (!halsband_index.insert(halsbandnr, uint8_t(i)))
+				LogError("Halsband index full");
+			return;
+		}
+	}
 };
 
 #undef LOG_ASSERT
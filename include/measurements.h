@@ -1,11 +1,32 @@
 #pragma once
 
 #include <iostream>
+#include <algorithm>
 
+#include "pico/stdlib.h"
 #include "static_types.h"
 
 struct measurements {
 	float i_low{};
+	uint32_t reload_last_feeds_us{}; // boot time spent in kuhspeicher::reload_last_feeds()
+	int reload_last_feeds_cows{};
+	uint32_t arrival_to_ration_ms{}; // time from a cow entering a station to its first dispensed ration, last value
+	uint32_t arrival_to_ration_max_ms{};
+	uint32_t rations_dispensed{}; // since boot, over all stations
+	uint32_t ration_wait_ms{}; // time from fetching the rations of a cow to dispensing its last one, last value
+	uint32_t ration_wait_max_ms{};
+	int rations_in_flight_max{}; // high water mark of rations_in_flight::halsband_rationen
+	uint32_t rations_in_flight_full{}; // cows which could not get rations as no slot was free
+
+	void add_arrival_to_ration(uint32_t ms) {
+		arrival_to_ration_ms = ms;
+		arrival_to_ration_max_ms = std::max(arrival_to_ration_max_ms, ms);
+	}
+	void add_ration_wait(uint32_t ms) {
+		ration_wait_ms = ms;
+		ration_wait_max_ms = std::max(ration_wait_max_ms, ms);
+	}
+	void add_rations_in_flight(int count) { rations_in_flight_max = std::max(rations_in_flight_max, count); }
 
 	static measurements& Default() {
 		static measurements m{};
@@ -14,13 +35,21 @@ struct measurements {
 	/** @brief writes the measurements struct as json to the static string */
 	template<int N>
 	constexpr void dump_to_json(static_string<N> &s) const {
-		s.append_formatted(R"({{"i_low":{}}})", i_low);
+		s.append_formatted(R"({{"i_low":{},"reload_last_feeds_us":{},"reload_last_feeds_cows":{},"arrival_to_ration_ms":{},"arrival_to_ration_max_ms":{},)"
+			R"("rations_dispensed":{},"ration_wait_ms":{},"ration_wait_max_ms":{},"rations_in_flight_max":{},"rations_in_flight_full":{}}})",
+			i_low, reload_last_feeds_us, reload_last_feeds_cows, arrival_to_ration_ms, arrival_to_ration_max_ms,
+			rations_dispensed, ration_wait_ms, ration_wait_max_ms, rations_in_flight_max, rations_in_flight_full);
 	}
 };
 
 /** @brief prints formatted for monospace output, eg. usb */
 std::ostream& operator<<(std::ostream &os, const measurements &m) {
 	os << "i_low:    " << m.i_low << '\n';
+	os << "reload_last_feeds: " << m.reload_last_feeds_us << " us for " << m.reload_last_feeds_cows << " cows\n";
+	os << "arrival_to_ration: " << m.arrival_to_ration_ms << " ms (max " << m.arrival_to_ration_max_ms << " ms)\n";
+	os << "rations_dispensed: " << m.rations_dispensed << " (" << m.rations_dispensed * 60e6f / std::max<uint64_t>(time_us_64(), 1) << " per minute)\n";
+	os << "ration_wait: " << m.ration_wait_ms << " ms (max " << m.ration_wait_max_ms << " ms)\n";
+	os << "rations_in_flight: max " << m.rations_in_flight_max << ", full " << m.rations_in_flight_full << " times\n";
 	return os;
 }
 
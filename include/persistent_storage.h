@@ -1,11 +1,15 @@
 #pragma once
 
 #include <cmath>
+#include <iostream>
+#include <ranges>
 #include <span>
+#include <utility>
 
 #include "pico/flash.h"
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
+#include "hardware/watchdog.h"
 
 #include "log_storage.h"
 #include "settings.h"
@@ -14,11 +18,17 @@
 constexpr uint32_t FLASH_SIZE{PICO_FLASH_SIZE_BYTES};
 
 constexpr int MAX_COWS{256};
+constexpr int MAX_RATIONS_IN_FLIGHT{64};
 
 struct feed_entry {
-	uint8_t station:2 {};
-	uint32_t timestamp: 30{}; // timestamp in minutes since start of epoch 1970
+	uint8_t station:6 {}; // global station id over all buses
+	uint32_t timestamp: 26{}; // timestamp in minutes since start of epoch 1970, enough till 2097
 };
+static_assert(sizeof(feed_entry) == 4, "Feed entries have to keep their size to not move the storage layout");
+constexpr int MAX_STATION_ID{(1 << 6) - 1};
+// 1 (not stored): 2 bit station, 30 bit timestamp in feed_entry
+// 2: station_slot_timings and rations_in_flight not stored
+constexpr uint32_t LAYOUT_VERSION{3};
 
 struct kuh {
 	static_string<15, uint8_t> name;
@@ -33,6 +43,10 @@ struct kuh {
  * as the elements at the back of the layout always stay in the same position
  */
 struct persistent_storage_layout {
+	station_slot_timing station_slot_timings;
+	std::array<uint32_t, 1 + MAX_RATIONS_IN_FLIGHT> reserved; // was the rations in flight table, now kept in ram (see retained_rations)
+	uint32_t layout_version; // format of the stored data, converted by kuhspeicher::migrate_storage()
+	station_bus_timing station_timings;
 	// settings
 	settings setting;
 	// main cow stuff storage
@@ -48,6 +62,29 @@ struct persistent_storage_layout {
 
 static char *flash_begin{reinterpret_cast<char*>(uintptr_t(XIP_BASE))};
 
+/** @brief Counters to observe the write amplification of the persistent storage */
+struct flash_write_stats {
+	uint32_t sectors_erased{};
+	uint32_t erases_avoided{}; // sectors which only needed 1 -> 0 bit changes and were programmed without erase
+	uint32_t pages_programmed{};
+	uint32_t bytes_programmed{};
+	uint32_t bytes_requested{}; // bytes handed to write() and write_array_range()
+	uint32_t writes_coalesced{}; // writes which only updated a record already waiting in the write-back cache
+	uint32_t cache_flushes{};
+};
+
+/** @brief prints formatted for monospace output, eg. usb */
+std::ostream& operator<<(std::ostream &os, const flash_write_stats &s) {
+	os << "sectors_erased   " << s.sectors_erased << '\n';
+	os << "erases_avoided   " << s.erases_avoided << '\n';
+	os << "pages_programmed " << s.pages_programmed << '\n';
+	os << "bytes_programmed " << s.bytes_programmed << '\n';
+	os << "bytes_requested  " << s.bytes_requested << '\n';
+	os << "writes_coalesced " << s.writes_coalesced << '\n';
+	os << "cache_flushes    " << s.cache_flushes << '\n';
+	return os;
+}
+
 /** 
  * @brief  strcut to easily access/setup permanent storage with a static size and lots of compile time validations.
  * Sets up the storage at the very end of the memory range and acquires as many bytes as needed for the persistent_mem_layout struct
@@ -73,118 +110,618 @@ static char *flash_begin{reinterpret_cast<char*>(uintptr_t(XIP_BASE))};
  * int mem_b;
  * persistent_storage_t::Default().write(mem_b, &layout::storage_b);
  * persistent_storage_t::Default().read(&layout::storage_b, mem_b);
+ *
+ * # journal
+ * Small writes (single values or array elements up to journal_max_record_size) are not written in place,
+ * but appended to a log of pre-erased sectors in front of the storage (program only, no sector erase).
+ * read() and view() always return the newest version, merging the journal with the main storage.
+ * The journal is compacted into the main storage by maintain() when it gets full. Array members should
+ * therefore be accessed via view(member, start, end), which resolves every element on its own.
+ *
+ * # write-back cache
+ * Small writes are first only copied to a RAM cache and return immediately. maintain() flushes the cache
+ * flush_delay_ms after the first dirty write or as soon as flush_threshold bytes are dirty, repeated writes
+ * to the same record in between are coalesced. Call flush() before a reboot to not loose any writes.
+ * view() returns copies, as the maintenance task can move cached records or erase the journal at any time.
+ *
+ * # batches
+ * Between begin_batch() and commit() the cache is not flushed in the background and full sectors are written
+ * directly instead of going through the journal, so bulk updates write every touched sector about once.
  */
 
-template<typename persistent_mem_layout, int MAX_WRITE_SIZE = 2 * FLASH_SECTOR_SIZE>
+template<typename persistent_mem_layout, int MAX_WRITE_SIZE = 2 * FLASH_SECTOR_SIZE, int JOURNAL_SECTORS = 16, int JOURNAL_MAX_RECORDS = 256>
 struct persistent_storage {
 	static constexpr uint32_t begin_offset{FLASH_SIZE - sizeof(persistent_mem_layout)}; // flash page alignment is done only when writing
 	const char *storage_begin{flash_begin + begin_offset};
 	const char *storage_end{flash_begin + FLASH_SIZE}; // 2MB after flash start is end
 
+	// journal directly in front of the sector holding the layout begin, JOURNAL_SECTORS = 0 disables the journal
+	static constexpr uint32_t journal_offset{begin_offset / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE - JOURNAL_SECTORS * FLASH_SECTOR_SIZE};
+	static constexpr uint32_t journal_size{JOURNAL_SECTORS * FLASH_SECTOR_SIZE};
+	static constexpr uint32_t journal_max_record_size{FLASH_SECTOR_SIZE / 4}; // larger writes bypass the journal
+	static constexpr uint32_t journal_compact_threshold{journal_size * 3 / 4}; // background compaction above this fill level
+	static constexpr uint32_t JOURNAL_MAGIC{0x4c4e524a}; // "JRNL"
+	static constexpr uint32_t JOURNAL_INVALIDATED{0}; // magic of the first record once the journal is compacted, programmable without erase
+	static constexpr uint32_t layout_sectors{(FLASH_SIZE - begin_offset / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE) / FLASH_SECTOR_SIZE};
+	static_assert(MAX_WRITE_SIZE >= FLASH_SECTOR_SIZE + journal_max_record_size, "Write buffer has to hold a sector and a staged journal record");
+	static constexpr uint32_t DIRTY_RECORDS{32};
+	static constexpr uint32_t DIRTY_BYTES{8 * journal_max_record_size}; // 2 sectors to be able to hold back a partially written sector in batches
+	static_assert(DIRTY_BYTES <= 0xffff, "Cache positions are stored as uint16_t");
+
 	static persistent_storage& Default() {
 		static persistent_storage p{};
+		[[maybe_unused]] static bool inited = [](){ p._journal_load(); return true; }();
 		return p;
 	}
 
 	mutex _memory_mutex{};
 	std::array<char, MAX_WRITE_SIZE> _write_buffer{};
+	uint32_t _journal_pos{}; // end of the last journal record relative to journal_offset
+	static_hash_map<uint32_t, uint32_t, JOURNAL_MAX_RECORDS> _journal_index{}; // layout offset -> record data relative to journal_offset
+	bool _journal_enabled{JOURNAL_SECTORS > 0};
+	bool diff_writes{true}; // skip the erase if only 1 -> 0 bit changes are needed and only program changed pages
+	flash_write_stats stats{};
+	uint32_t flush_delay_ms{2000}; // max time a write stays only in the ram cache
+	uint32_t flush_threshold{DIRTY_BYTES / 2}; // dirty bytes from which on the cache is flushed without waiting for the delay
+	// pos is the data position in _dirty_data, written has a bit per spanned sector already written in a batch
+	/*INTERNAL*/ struct _dirty_record { uint32_t offset; uint16_t size; uint16_t pos; uint8_t written{}; };
+	static_vector<_dirty_record, DIRTY_RECORDS> _dirty{};
+	std::array<char, DIRTY_BYTES> _dirty_data{};
+	uint32_t _dirty_pos{};
+	uint64_t _first_dirty_ms{};
+	int _batch_depth{};
+	bool _compaction_requested{}; // by begin_batch_if_ready(), done by the next maintain()
 
 	template<typename M>
 	using mem_t = std::decay_t<decltype(std::declval<persistent_mem_layout>().*std::declval<M>())>;
 
+	/** @brief Span like view over an array member. The elements are resolved one by one
+	  * as every element can live either in the main storage or in the journal */
+	template<typename T>
+	struct array_view {
+		const persistent_storage *storage{};
+		uint32_t offset{}; // offset of the first element relative to the layout begin
+		uint32_t count{};
+		struct iterator {
+			const array_view *view{};
+			uint32_t i{};
+			T operator*() const { return (*view)[i]; }
+			iterator& operator++() { ++i; return *this; }
+			bool operator==(const iterator &o) const { return i == o.i; }
+		};
+		/** @brief returns a copy, the flash or cache data can be moved or erased as soon as the lock is released */
+		T operator[](uint32_t i) const {
+			T e;
+			scoped_lock lock{storage->_memory_mutex};
+			storage->_resolve(offset + i * sizeof(T), reinterpret_cast<char*>(&e), sizeof(T));
+			return e;
+		}
+		T back() const { return (*this)[count - 1]; }
+		uint32_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		array_view subspan(uint32_t o, uint32_t n) const { return {storage, uint32_t(offset + o * sizeof(T)), n}; }
+		iterator begin() const { return {this, 0}; }
+		iterator end() const { return {this, count}; }
+	};
+
 	/** @brief To be used with member pointers: int Struct:: *member = &Struct::member_a; */
 	template<typename M, typename T = mem_t<M>> requires (std::islessequal(sizeof(T), MAX_WRITE_SIZE))
 	err_t write(const T &data, M member) {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		uint32_t start_idx_data = begin_offset + *reinterpret_cast<uintptr_t*>(&member);
-		uint32_t start_idx_paged = start_idx_data / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		uint32_t end_idx_data = start_idx_data + sizeof(T);
-		uint32_t end_idx_paged = (end_idx_data + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		if (end_idx_paged - start_idx_paged > MAX_WRITE_SIZE) {
-			LogError("persistent_storage::write() too large data to write, abort.");
-			return PICO_ERROR_GENERIC;
-		}
-		scoped_lock lock{_memory_mutex};
-		memcpy(_write_buffer.data() + start_idx_data - start_idx_paged, &data, sizeof(T));
-		#pragma GCC diagnostic pop
-		return _write_impl(start_idx_paged, start_idx_data, end_idx_data, end_idx_paged);
+		stats.bytes_requested += sizeof(T);
+		if (sizeof(T) <= journal_max_record_size)
+			return _cache_write(_member_offset(member), reinterpret_cast<const char*>(&data), sizeof(T));
+		return _write_direct(_member_offset(member), reinterpret_cast<const char*>(&data), sizeof(T));
 	}
 	/** @brief Range based write overload, see write() for usage. Size has to be given in bytes written */
 	template<typename M, typename T = mem_t<M>::value_t>
 	err_t write_array_range(const T *data, M member, uint32_t start_idx, uint32_t end_idx) {
 		if (start_idx == end_idx)
 			return PICO_OK;
-		if (end_idx > view(member).size() || start_idx > view(member).size() || start_idx > end_idx) {
+		constexpr uint32_t size = std::tuple_size_v<mem_t<M>>;
+		if (end_idx > size || start_idx > size || start_idx > end_idx) {
 			LogError("persistent_storage::write() indices out of bounds, abort.");
 			return PICO_ERROR_GENERIC;
 		}
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		uint32_t start_idx_data = begin_offset + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T);
-		uint32_t start_idx_paged = start_idx_data / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		uint32_t end_idx_data = start_idx_data + sizeof(T) * (end_idx - start_idx);
-		uint32_t end_idx_paged = (end_idx_data + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		if (end_idx_paged - start_idx_paged > MAX_WRITE_SIZE) {
-			LogError("persistent_storage::write() too large data to write, abort.");
-			return PICO_ERROR_GENERIC;
+		uint32_t offset = _member_offset(member) + start_idx * sizeof(T);
+		stats.bytes_requested += sizeof(T) * (end_idx - start_idx);
+		if (sizeof(T) > journal_max_record_size)
+			return _write_direct(offset, reinterpret_cast<const char*>(data), sizeof(T) * (end_idx - start_idx));
+		// every element is a separate record so that views can resolve single elements
+		for (uint32_t i: std::ranges::iota_view{start_idx, end_idx}) {
+			err_t res = _cache_write(offset + (i - start_idx) * sizeof(T), reinterpret_cast<const char*>(data + i - start_idx), sizeof(T));
+			if (res != PICO_OK)
+				return res;
 		}
-		scoped_lock lock{_memory_mutex};
-		memcpy(_write_buffer.data() + start_idx_data - start_idx_paged, data, end_idx_data - start_idx_data);
-		#pragma GCC diagnostic pop
-		return _write_impl(start_idx_paged, start_idx_data, end_idx_data, end_idx_paged);
+		return PICO_OK;
 	}
 	template<typename M, typename T = mem_t<M>> requires (std::islessequal(sizeof(T), MAX_WRITE_SIZE))
 	void read(M member, T& out) const {
-		// read is a simple copy from flash memory
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
 		scoped_lock lock{_memory_mutex};
-		memcpy(&out, storage_begin + *reinterpret_cast<uintptr_t*>(&member), sizeof(T));
-		#pragma GCC diagnostic pop
+		_merged_read(_member_offset(member), reinterpret_cast<char*>(&out), sizeof(T));
 	}
 	template<typename M, typename T = mem_t<M>::value_type>
 	void read_array_range(M member, uint32_t start_idx, uint32_t end_idx, T* out) const {
-		// read is a simple copy from flash memory
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
 		scoped_lock lock{_memory_mutex};
-		memcpy(out, storage_begin + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T), sizeof(T) * (end_idx - start_idx));
-		#pragma GCC diagnostic pop
+		_merged_read(_member_offset(member) + start_idx * sizeof(T), reinterpret_cast<char*>(out), sizeof(T) * (end_idx - start_idx));
 	}
 	template<typename M, typename T = mem_t<M>>
-	const T& view(M member) const {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+	T view(M member) const {
+		T e;
 		scoped_lock lock{_memory_mutex};
-		return *reinterpret_cast<const T*>(storage_begin + *reinterpret_cast<uintptr_t*>(&member));
-		#pragma GCC diagnostic pop
+		_resolve(_member_offset(member), reinterpret_cast<char*>(&e), sizeof(T));
+		return e;
 	}
 	template<typename M, typename T = mem_t<M>::value_type>
-	std::span<T> view(M member, uint32_t start_idx, uint32_t end_idx) const {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+	array_view<T> view(M member, uint32_t start_idx, uint32_t end_idx) const {
+		return {this, uint32_t(_member_offset(member) + start_idx * sizeof(T)), end_idx - start_idx};
+	}
+
+	/** @brief Writes all cached writes to flash, eg. before a reboot */
+	err_t flush() {
 		scoped_lock lock{_memory_mutex};
-		return {(T*)(storage_begin + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T)), end_idx - start_idx};
-		#pragma GCC diagnostic pop
+		return _flush();
+	}
+	/** @brief Starts collecting all writes in the ram cache until commit(), batches can be nested */
+	err_t begin_batch() {
+		scoped_lock lock{_memory_mutex};
+		if (_batch_depth) {
+			++_batch_depth;
+			return PICO_OK;
+		}
+		// batches write sectors directly, so the journal has to be empty to not shadow them with older records.
+		// Writes still in the cache are newer than the flash and are written together with the batch
+		err_t res{PICO_OK};
+		if (_journal_pos) {
+			res = _flush();
+			if (res == PICO_OK)
+				res = _compact();
+		}
+		++_batch_depth;
+		return res;
+	}
+	/** @brief Starts a batch only if that needs no journal compaction, else the compaction is requested from maintain()
+	  * and false is returned. For batches started where blocking for a compaction is not possible, eg. lwIP callbacks */
+	bool begin_batch_if_ready() {
+		scoped_lock lock{_memory_mutex};
+		if (_journal_pos && !_batch_depth) {
+			_compaction_requested = true;
+			return false;
+		}
+		++_batch_depth;
+		return true;
+	}
+	/** @brief Ends a batch, writing every sector touched by it once */
+	err_t commit() {
+		scoped_lock lock{_memory_mutex};
+		if (_batch_depth == 0 || --_batch_depth)
+			return PICO_OK;
+		return _flush();
+	}
+	/** @brief Merges all journal records into the main storage and erases the journal */
+	err_t compact() {
+		scoped_lock lock{_memory_mutex};
+		return _compact();
+	}
+	/** @brief Background maintenance, flushes the write-back cache when due and compacts the journal when
+	  * it gets full. To be called regularly from a low priority task */
+	void maintain() {
+		bool requested{};
+		{
+			scoped_lock lock{_memory_mutex};
+			requested = std::exchange(_compaction_requested, false);
+			// for a requested compaction the cache is flushed right away, so the journal stays empty until the next flush
+			if (!_dirty.empty() && !_batch_depth && (requested || time_us_64() / 1000 - _first_dirty_ms >= flush_delay_ms || _dirty_pos >= flush_threshold) &&
+			    PICO_OK != _flush())
+				LogError("Failed to flush storage cache");
+		}
+		if (requested || _journal_pos > journal_compact_threshold || _journal_index.size() > JOURNAL_MAX_RECORDS * 3 / 4) {
+			LogInfo("Compacting storage journal, {} bytes", _journal_pos);
+			if (PICO_OK != compact())
+				LogError("Failed to compact storage journal");
+		}
 	}
 
 	/*INTERNAL*/ struct _write_data {const char *src_start, *src_end; uint32_t dst_offset;}; // dst offset is the offset of the flash begin
-	/*INTERNAL*/ err_t _write_impl(uint32_t start_paged, uint32_t start_data, uint32_t end_data, uint32_t end_paged) {
-		if (start_data != start_paged)
-			memcpy(_write_buffer.data(), flash_begin + start_paged, start_data - start_paged);	
-		if (end_data != end_paged)
-			memcpy(_write_buffer.data() + end_data - start_paged, flash_begin + end_data, end_paged - end_data);	
+	// offset_from_end is counted from the end of the layout, so records stay valid if members are added at the front
+	/*INTERNAL*/ struct _journal_header { uint32_t magic; uint32_t offset_from_end; uint16_t size; uint16_t checksum; };
+	template<typename M>
+	/*INTERNAL*/ static uint32_t _member_offset(M member) {
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+		return *reinterpret_cast<uintptr_t*>(&member);
+		#pragma GCC diagnostic pop
+	}
+	/*INTERNAL*/ static constexpr uint32_t _align4(uint32_t s) { return (s + 3) / 4 * 4; }
+	/*INTERNAL*/ static uint16_t _checksum(uint32_t offset, const char *data, uint32_t size) {
+		uint32_t h = fnv1a(std::string_view{data, size}) ^ (offset * 16777619u) ^ size;
+		return uint16_t(h ^ (h >> 16));
+	}
+	/** @brief copies the newest version of the record at offset (relative to layout begin), has to be called with locked mutex.
+	  * A single lookup for a record written as a whole, ranges overlapped by differently placed writes are merged */
+	/*INTERNAL*/ void _resolve(uint32_t offset, char *out, uint32_t size) const {
+		for (int i = _dirty.size() - 1; i >= 0; --i) {
+			const _dirty_record &r = _dirty[i];
+			if (r.offset == offset && r.size == size) {
+				memcpy(out, _dirty_data.data() + r.pos, size);
+				return;
+			}
+			if (r.offset < offset + size && offset < r.offset + r.size)
+				return _merged_read(offset, out, size);
+		}
+		if (const char *flash = _resolve_flash(offset, size))
+			memcpy(out, flash, size);
+		else
+			_merged_read(offset, out, size);
+	}
+	/** @brief same as _resolve() but ignoring the write-back cache, nullptr if the journal holds a differently sized record at offset */
+	/*INTERNAL*/ const char* _resolve_flash(uint32_t offset, uint32_t size) const {
+		const uint32_t *record = _journal_index.find(offset);
+		if (!record)
+			return storage_begin + offset;
+		const char *data = flash_begin + journal_offset + *record;
+		if (reinterpret_cast<const _journal_header*>(data - sizeof(_journal_header))->size != size)
+			return nullptr;
+		return data;
+	}
+	/** @brief copies the main storage and overlays all journal and cached records intersecting the range */
+	/*INTERNAL*/ void _merged_read(uint32_t offset, char *out, uint32_t size) const {
+		memcpy(out, storage_begin + offset, size);
+		for (const auto &[record_offset, record, used]: _journal_index.storage) {
+			if (!used)
+				continue;
+			const char *data = flash_begin + journal_offset + record;
+			uint32_t record_end = record_offset + reinterpret_cast<const _journal_header*>(data - sizeof(_journal_header))->size;
+			uint32_t s = std::max(offset, record_offset), e = std::min(offset + size, record_end);
+			if (s < e)
+				memcpy(out + s - offset, data + s - record_offset, e - s);
+		}
+		// cached records are applied last and in write order as they are newer than everything in flash
+		for (const _dirty_record &r: _dirty) {
+			uint32_t s = std::max(offset, r.offset), e = std::min(offset + size, r.offset + r.size);
+			if (s < e)
+				memcpy(out + s - offset, _dirty_data.data() + r.pos + s - r.offset, e - s);
+		}
+	}
+	/** @brief copies the write into the ram cache, only flushes directly if the cache is full */
+	/*INTERNAL*/ err_t _cache_write(uint32_t offset, const char *data, uint32_t size) {
+		scoped_lock lock{_memory_mutex};
+		bool overlap{};
+		for (int i = _dirty.size() - 1; i >= 0 && !overlap; --i) {
+			_dirty_record &r = _dirty[i];
+			if (r.offset == offset && r.size == size) {
+				memmove(_dirty_data.data() + r.pos, data, size);
+				r.written = 0;
+				++stats.writes_coalesced;
+				return PICO_OK;
+			}
+			overlap = r.offset < offset + size && offset < r.offset + r.size;
+		}
+		if (const char *flash = _resolve_flash(offset, size); !overlap && flash && memcmp(flash, data, size) == 0)
+			return PICO_OK; // nothing changed
+		if (_dirty.empty())
+			_first_dirty_ms = time_us_64() / 1000;
+		// by the check below there is always space for one more record
+		memmove(_dirty_data.data() + _dirty_pos, data, size);
+		_dirty.push(_dirty_record{.offset = offset, .size = uint16_t(size), .pos = uint16_t(_dirty_pos)});
+		_dirty_pos += _align4(size);
+		if (_cache_full() && _batch_depth) {
+			err_t res = _flush_sectors(true);
+			if (res != PICO_OK)
+				return res;
+		}
+		if (_cache_full())
+			return _flush();
+		return PICO_OK;
+	}
+	/*INTERNAL*/ bool _cache_full() const { return _dirty.size() == int(DIRTY_RECORDS) || _dirty_pos + journal_max_record_size > DIRTY_BYTES; }
+	/** @brief writes all cached records to the journal, or without journal/in a batch each touched sector once. Has to be called with locked mutex */
+	/*INTERNAL*/ err_t _flush() {
+		if (_dirty.empty())
+			return PICO_OK;
+		if (!_journal_enabled || _batch_depth)
+			return _flush_sectors(false);
+		if (_flush_overlaps()) {
+			err_t res = _compact();
+			if (res != PICO_OK)
+				return res;
+			return _flush_sectors(false);
+		}
+		++stats.cache_flushes;
+		for (const _dirty_record &r: _dirty) {
+			err_t res = _journal_append(r.offset, _dirty_data.data() + r.pos, r.size);
+			if (res != PICO_OK)
+				return res;
+		}
+		_dirty.clear();
+		_dirty_pos = 0;
+		return PICO_OK;
+	}
+	/** @brief true if a cached record overlaps another one or a journal record without matching its range.
+	  * The journal index only finds records by their offset, so these are written to the sectors instead */
+	/*INTERNAL*/ bool _flush_overlaps() const {
+		for (int i: std::ranges::iota_view{0, _dirty.size()}) {
+			const _dirty_record &r = _dirty[i];
+			for (int j: std::ranges::iota_view{0, i})
+				if (_dirty[j].offset < r.offset + r.size && r.offset < _dirty[j].offset + _dirty[j].size)
+					return true;
+			for (const auto &[offset, record, used]: _journal_index.storage) {
+				if (!used)
+					continue;
+				uint32_t size = reinterpret_cast<const _journal_header*>(flash_begin + journal_offset + record - sizeof(_journal_header))->size;
+				if ((offset != r.offset || size != r.size) && offset < r.offset + r.size && r.offset < offset + size)
+					return true;
+			}
+		}
+		return false;
+	}
+	/** @brief writes the sectors touched by cached records directly. With keep_latest the sectors of the newest record
+	  * are held back (a sequential bulk write most likely continues there) together with all records touching them */
+	/*INTERNAL*/ err_t _flush_sectors(bool keep_latest) {
+		++stats.cache_flushes;
+		std::array<bool, layout_sectors> touched{};
+		for (const _dirty_record &r: _dirty)
+			_mark_sectors(touched, r.offset, r.size, r.written);
+		if (keep_latest) {
+			std::array<bool, layout_sectors> latest{};
+			const _dirty_record &l = _dirty[_dirty.size() - 1];
+			_mark_sectors(latest, l.offset, l.size, l.written);
+			bool any{};
+			for (uint32_t i: std::ranges::iota_view{0u, layout_sectors}) {
+				touched[i] = touched[i] && !latest[i];
+				any |= touched[i];
+			}
+			if (!any)
+				touched = latest;
+		}
+		err_t res = _write_sectors(touched);
+		if (res != PICO_OK)
+			return res;
+		// keep the records not fully written, in order and moved to the front of the cache data
+		constexpr uint32_t first_sector = begin_offset / FLASH_SECTOR_SIZE;
+		int kept{};
+		uint32_t pos{};
+		for (int i: std::ranges::iota_view{0, _dirty.size()}) {
+			_dirty_record r = _dirty[i];
+			uint32_t first = (begin_offset + r.offset) / FLASH_SECTOR_SIZE, last = (begin_offset + r.offset + r.size - 1) / FLASH_SECTOR_SIZE;
+			for (uint32_t s: std::ranges::iota_view{first, last + 1})
+				if (touched[s - first_sector])
+					r.written |= 1 << (s - first);
+			if (r.written == (1 << (last - first + 1)) - 1)
+				continue;
+			memmove(_dirty_data.data() + pos, _dirty_data.data() + r.pos, r.size);
+			r.pos = uint16_t(pos);
+			_dirty[kept++] = r;
+			pos += _align4(r.size);
+		}
+		_dirty.cur_size = kept;
+		_dirty_pos = pos;
+		return PICO_OK;
+	}
+	/** @brief has to be called with locked mutex */
+	/*INTERNAL*/ err_t _journal_append(uint32_t offset, const char *data, uint32_t size) {
+		if (const char *flash = _resolve_flash(offset, size); flash && memcmp(flash, data, size) == 0)
+			return PICO_OK; // nothing changed, no need to grow the journal
+		// stage the data as it might point into the journal which is erased on compaction
+		char *staged = _write_buffer.data() + FLASH_SECTOR_SIZE;
+		memcpy(staged, data, size);
+		uint32_t entry_size = _align4(sizeof(_journal_header) + size);
+		if (_journal_pos + entry_size > journal_size || _journal_index.size() >= JOURNAL_MAX_RECORDS - 1) {
+			err_t res = _compact();
+			if (res != PICO_OK)
+				return res;
+		}
+		uint32_t offset_from_end = sizeof(persistent_mem_layout) - offset;
+		_journal_header header{.magic = JOURNAL_MAGIC, .offset_from_end = offset_from_end, .size = uint16_t(size), .checksum = _checksum(offset_from_end, staged, size)};
+		// only the pages holding the new record are programmed, all other bytes stay 0xff and thus unchanged
+		uint32_t start = journal_offset + _journal_pos;
+		uint32_t start_paged = start / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+		uint32_t end_paged = (start + entry_size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+		memset(_write_buffer.data(), 0xff, end_paged - start_paged);
+		memcpy(_write_buffer.data() + start - start_paged, &header, sizeof(header));
+		memcpy(_write_buffer.data() + start - start_paged + sizeof(header), staged, size);
 		_write_data write_data{.src_start = _write_buffer.data(), 
 					.src_end = _write_buffer.data() + end_paged - start_paged, 
 					.dst_offset = start_paged};
-		// first erase as flash_range_program only allows to change 1s to 0s, but not the other way around
-		err_t res = flash_safe_execute(_flash_erase, (void*)&write_data, 500);
+		err_t res = flash_safe_execute(_flash_program, (void*)&write_data, 500);
+		if (res != PICO_OK)
+			return res;
+		stats.pages_programmed += (end_paged - start_paged) / FLASH_PAGE_SIZE;
+		stats.bytes_programmed += end_paged - start_paged;
+		if (!_journal_index.insert(offset, _journal_pos + sizeof(header))) {
+			LogError("persistent_storage journal index full");
+			return PICO_ERROR_GENERIC;
+		}
+		_journal_pos += entry_size;
+		return PICO_OK;
+	}
+	/** @brief rebuilds the journal index from flash, compacts directly if a torn record was found */
+	/*INTERNAL*/ void _journal_load() {
+		extern char __flash_binary_end;
+		if (!_journal_enabled)
+			return;
+		if (uintptr_t(&__flash_binary_end) > uintptr_t(flash_begin + journal_offset)) {
+			LogError("Program overlaps storage journal, journal disabled");
+			_journal_enabled = false;
+			return;
+		}
+		scoped_lock lock{_memory_mutex};
+		if (reinterpret_cast<const _journal_header*>(flash_begin + journal_offset)->magic == JOURNAL_INVALIDATED) {
+			// a compaction was interrupted after all records were written to the main storage, replaying would roll them back
+			LogWarning("Storage journal was compacted but not erased, erasing");
+			_journal_pos = journal_size;
+			if (PICO_OK != _journal_erase())
+				LogError("Failed to erase storage journal");
+			return;
+		}
+		bool corrupt{};
+		for (_journal_pos = 0; _journal_pos + sizeof(_journal_header) <= journal_size;) {
+			const char *entry = flash_begin + journal_offset + _journal_pos;
+			const _journal_header &header = *reinterpret_cast<const _journal_header*>(entry);
+			if (header.magic == 0xffffffff)
+				break; // erased flash, end of journal
+			uint32_t entry_size = _align4(sizeof(header) + header.size);
+			corrupt = header.magic != JOURNAL_MAGIC || header.offset_from_end > sizeof(persistent_mem_layout) || header.size > header.offset_from_end ||
+				_journal_pos + entry_size > journal_size ||
+				header.checksum != _checksum(header.offset_from_end, entry + sizeof(header), header.size) ||
+				!_journal_index.insert(sizeof(persistent_mem_layout) - header.offset_from_end, _journal_pos + sizeof(header));
+			if (corrupt)
+				break;
+			_journal_pos += entry_size;
+		}
+		LogInfo("Loaded storage journal with {} records", _journal_index.size());
+		if (!corrupt && !_journal_blank_from(_journal_pos)) {
+			LogWarning("Storage journal not erased behind its end");
+			corrupt = true;
+		}
+		if (corrupt) {
+			LogWarning("Storage journal has a broken record, compacting");
+			_journal_pos = journal_size; // erase the full journal
+			if (PICO_OK != _compact())
+				LogError("Failed to compact storage journal");
+		}
+	}
+	/** @brief true if the journal only holds erased flash from pos on. New records are programmed there without erase,
+	  * so leftovers of an interrupted compaction would corrupt them */
+	/*INTERNAL*/ bool _journal_blank_from(uint32_t pos) const {
+		const uint32_t *journal = reinterpret_cast<const uint32_t*>(flash_begin + journal_offset);
+		for (uint32_t i = _align4(pos) / 4; i < journal_size / 4; ++i)
+			if (journal[i] != 0xffffffff)
+				return false;
+		return true;
+	}
+	/*INTERNAL*/ err_t _compact() {
+		if (_journal_pos == 0)
+			return PICO_OK;
+		std::array<bool, layout_sectors> touched{};
+		for (const auto &[offset, record, used]: _journal_index.storage) {
+			if (!used)
+				continue;
+			_mark_sectors(touched, offset, reinterpret_cast<const _journal_header*>(flash_begin + journal_offset + record - sizeof(_journal_header))->size);
+		}
+		err_t res = _write_sectors(touched);
 		if (res != PICO_OK)
 			return res;
+		// only after all records are in the main storage the journal is invalidated, a crash before simply replays the journal again.
+		// Clearing the magic of the first record is a single program, a crash while erasing then can not leave records behind
+		// which would be replayed over the newer main storage
+		const uint32_t first_page = journal_offset;
+		memcpy(_write_buffer.data(), flash_begin + first_page, FLASH_PAGE_SIZE);
+		reinterpret_cast<_journal_header*>(_write_buffer.data())->magic = JOURNAL_INVALIDATED;
+		_write_data write_data{.src_start = _write_buffer.data(), 
+					.src_end = _write_buffer.data() + FLASH_PAGE_SIZE, 
+					.dst_offset = first_page};
 		res = flash_safe_execute(_flash_program, (void*)&write_data, 500);
 		if (res != PICO_OK)
 			return res;
+		++stats.pages_programmed;
+		stats.bytes_programmed += FLASH_PAGE_SIZE;
+		return _journal_erase();
+	}
+	/** @brief erases the journal sectors up to _journal_pos and clears the index */
+	/*INTERNAL*/ err_t _journal_erase() {
+		for (uint32_t sector = 0; sector < (_journal_pos + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE; ++sector) {
+			_write_data write_data{.src_start = _write_buffer.data(), 
+						.src_end = _write_buffer.data() + FLASH_SECTOR_SIZE, 
+						.dst_offset = journal_offset + sector * FLASH_SECTOR_SIZE};
+			err_t res = flash_safe_execute(_flash_erase, (void*)&write_data, 500);
+			if (res != PICO_OK)
+				return res;
+			++stats.sectors_erased;
+			watchdog_update();
+		}
+		_journal_index.clear();
+		_journal_pos = 0;
+		return PICO_OK;
+	}
+	/** @brief marks the sectors spanned by [offset, offset + size), skipping the ones with a bit set in skip (relative to the first spanned sector) */
+	/*INTERNAL*/ static void _mark_sectors(std::array<bool, layout_sectors> &touched, uint32_t offset, uint32_t size, uint8_t skip = 0) {
+		constexpr uint32_t first_sector = begin_offset / FLASH_SECTOR_SIZE;
+		uint32_t first = (begin_offset + offset) / FLASH_SECTOR_SIZE;
+		for (uint32_t s = first; s <= (begin_offset + offset + size - 1) / FLASH_SECTOR_SIZE; ++s)
+			if (!(skip & (1 << (s - first))))
+				touched[s - first_sector] = true;
+	}
+	/** @brief rewrites each touched sector exactly once with the merged content, one flash_safe_execute per sector to not block the other core too long */
+	/*INTERNAL*/ err_t _write_sectors(const std::array<bool, layout_sectors> &touched) {
+		constexpr uint32_t first_sector = begin_offset / FLASH_SECTOR_SIZE;
+		for (uint32_t i: std::ranges::iota_view{0u, layout_sectors}) {
+			if (!touched[i])
+				continue;
+			uint32_t sector = (first_sector + i) * FLASH_SECTOR_SIZE;
+			memcpy(_write_buffer.data(), flash_begin + sector, FLASH_SECTOR_SIZE);
+			if (sector + FLASH_SECTOR_SIZE > begin_offset) {
+				uint32_t s = std::max(sector, begin_offset) - begin_offset;
+				_merged_read(s, _write_buffer.data() + s + begin_offset - sector, sector + FLASH_SECTOR_SIZE - begin_offset - s);
+			}
+			err_t res = _write_impl(sector, sector, sector + FLASH_SECTOR_SIZE, sector + FLASH_SECTOR_SIZE);
+			if (res != PICO_OK)
+				return res;
+			// compactions and batches write many sectors in a row, each can take up to ~50 ms
+			watchdog_update();
+		}
+		return PICO_OK;
+	}
+	/** @brief writes directly to the main storage, the cache and all journal records are merged before */
+	/*INTERNAL*/ err_t _write_direct(uint32_t offset, const char *data, uint32_t size) {
+		uint32_t start_idx_data = begin_offset + offset;
+		uint32_t start_idx_paged = start_idx_data / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+		uint32_t end_idx_data = start_idx_data + size;
+		uint32_t end_idx_paged = (end_idx_data + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+		if (end_idx_paged - start_idx_paged > MAX_WRITE_SIZE) {
+			LogError("persistent_storage::write() too large data to write, abort.");
+			return PICO_ERROR_GENERIC;
+		}
+		scoped_lock lock{_memory_mutex};
+		// older cached writes must not end up on top of this write
+		err_t res = _flush();
+		if (res != PICO_OK)
+			return res;
+		res = _compact();
+		if (res != PICO_OK)
+			return res;
+		memcpy(_write_buffer.data() + start_idx_data - start_idx_paged, data, size);
+		return _write_impl(start_idx_paged, start_idx_data, end_idx_data, end_idx_paged);
+	}
+	/*INTERNAL*/ err_t _write_impl(uint32_t start_paged, uint32_t start_data, uint32_t end_data, uint32_t end_paged) {
+		if (start_data != start_paged)
+			memcpy(_write_buffer.data(), flash_begin + start_paged, start_data - start_paged);	
+		if (end_data != end_paged)
+			memcpy(_write_buffer.data() + end_data - start_paged, flash_begin + end_data, end_paged - end_data);	
+		const uint8_t *flash = reinterpret_cast<const uint8_t*>(flash_begin + start_paged);
+		const uint8_t *buffer = reinterpret_cast<const uint8_t*>(_write_buffer.data());
+		const uint32_t size = end_paged - start_paged;
+		// flash_range_program only allows to change 1s to 0s, so an erase is only needed if any 0 has to become a 1
+		bool needs_erase = !diff_writes;
+		for (uint32_t i = 0; i < size && !needs_erase; ++i)
+			needs_erase = (flash[i] & buffer[i]) != buffer[i];
+		if (needs_erase) {
+			_write_data write_data{.src_start = _write_buffer.data(), 
+						.src_end = _write_buffer.data() + size, 
+						.dst_offset = start_paged};
+			err_t res = flash_safe_execute(_flash_erase, (void*)&write_data, 500);
+			if (res != PICO_OK)
+				return res;
+			stats.sectors_erased += size / FLASH_SECTOR_SIZE;
+		} else
+			stats.erases_avoided += size / FLASH_SECTOR_SIZE;
+		// program consecutive runs of changed pages (after an erase all pages read as 0xff)
+		for (uint32_t page = 0; page < size;) {
+			if (diff_writes && memcmp(flash + page, buffer + page, FLASH_PAGE_SIZE) == 0) {
+				page += FLASH_PAGE_SIZE;
+				continue;
+			}
+			uint32_t run_end = page + FLASH_PAGE_SIZE;
+			for (; run_end < size && (!diff_writes || memcmp(flash + run_end, buffer + run_end, FLASH_PAGE_SIZE) != 0); run_end += FLASH_PAGE_SIZE);
+			_write_data write_data{.src_start = _write_buffer.data() + page, 
+						.src_end = _write_buffer.data() + run_end, 
+						.dst_offset = start_paged + page};
+			err_t res = flash_safe_execute(_flash_program, (void*)&write_data, 500);
+			if (res != PICO_OK)
+				return res;
+			stats.pages_programmed += (run_end - page) / FLASH_PAGE_SIZE;
+			stats.bytes_programmed += run_end - page;
+			page = run_end;
+		}
 		return PICO_OK;
 	}
 	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_erase)(void *d) {
@@ -201,3 +738,21 @@ struct persistent_storage {
 
 using persistent_storage_t = persistent_storage<persistent_storage_layout>;
 
+/** @brief writes station_timing::Default() to both stored parts */
+inline err_t store_station_timing() {
+	auto &storage = persistent_storage_t::Default();
+	const station_timing &t = station_timing::Default();
+	err_t res = storage.write(static_cast<const station_bus_timing&>(t), &persistent_storage_layout::station_timings);
+	if (res == PICO_OK)
+		res = storage.write(static_cast<const station_slot_timing&>(t), &persistent_storage_layout::station_slot_timings);
+	return res;
+}
+/** @brief loads station_timing::Default() from both stored parts and stores it back if it had to be sanitized */
+inline void load_station_timing() {
+	auto &storage = persistent_storage_t::Default();
+	station_timing &t = station_timing::Default();
+	storage.read(&persistent_storage_layout::station_timings, static_cast<station_bus_timing&>(t));
+	storage.read(&persistent_storage_layout::station_slot_timings, static_cast<station_slot_timing&>(t));
+	if (t.sanitize())
+		store_station_timing();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <ctime>
+
+#include "settings.h"
+
+constexpr time_t A_DAY = 24 * 60;
+
+/**
+ * @brief Caches the current ration window, which is the time between two reset offsets.
+ * The window is only recomputed if its end was passed, the time jumped back, or the
+ * reset settings changed, so checking a feed request costs a few integer comparisons.
+ * All times are given in minutes since epoch (utc).
+ */
+struct ration_window {
+	time_t start{};
+	time_t length{};
+	int reset_times{};
+	std::array<int, 3> reset_offsets{};
+
+	static ration_window& Default() {
+		static ration_window w{};
+		return w;
+	}
+
+	/** @brief recomputes the window if needed, returns true if the window changed */
+	bool update(time_t cur_mins) {
+		const auto &s = settings::Default();
+		if (length && start <= cur_mins && cur_mins < start + length &&
+		    reset_times == s.reset_times && reset_offsets == s.reset_offsets)
+			return false;
+		reset_times = s.reset_times;
+		reset_offsets = s.reset_offsets;
+		time_t day_start = cur_mins / A_DAY * A_DAY;
+		time_t minute = cur_mins - day_start;
+		time_t end = std::numeric_limits<time_t>::max();
+		start = std::numeric_limits<time_t>::min();
+		for (int i = 0; i < std::clamp(reset_times, 1, int(reset_offsets.size())); ++i) {
+			time_t o = reset_offsets[i];
+			start = std::max(start, day_start + (o <= minute ? o: o - A_DAY));
+			end = std::min(end, day_start + (o > minute ? o: o + A_DAY));
+		}
+		length = end - start;
+		return true;
+	}
+
+	/** @returns the amount of rations a cow is entitled to in the current window up to cur_mins */
+	int expected_feeds(time_t cur_mins) const {
+		return int((cur_mins - start) * settings::Default().rations / length) + 1;
+	}
+};
@@ -102,3 +102,157 @@ std::istream& operator>>(std::istream &is, settings &s) {
 	return is;
 }
 
+
+/** @brief Part of station_timing stored since layout version 2, its members must not change */
+struct station_bus_timing {
+	enum frame { p0, p1, p2, feed, p3, COUNT };
+	int pipelined{1};
+	std::array<int, COUNT> frame_timeouts_us{60000, 60000, 85000, 60000, 70000}; // p0, p1, p2, feed, p3
+	int frame_gap_us{10000}; // pause the stations need between the end of a frame and the next request
+	int buses{1}; // uarts with stations connected, the second bus is started after a reboot
+};
+static_assert(sizeof(station_bus_timing) == 32, "station_bus_timing is part of the storage layout");
+
+/** @brief Part of station_timing stored since layout version 3, new options take the place of reserved */
+struct station_slot_timing {
+	int feeds_per_slot{3}; // rations dispensed to a cow before the next station is polled, each after the dispense_timeout
+	int hw_timer{0}; // 1: frames are started by a hardware alarm with us precision, the task only prepares them in advance
+	std::array<int, 6> reserved{};
+};
+static_assert(sizeof(station_slot_timing) == 32, "station_slot_timing is part of the storage layout");
+
+/**
+ * @brief Timing of the station bus protocol.
+ * In the fixed profile every frame waits its full timeout. In the pipelined profile frames without answer only wait
+ * for their transmission plus frame_gap_us, frames with answer end as soon as the answer is complete.
+ * With hw_timer the frames are sent by a hardware alarm at their exact time instead of by the bus task.
+ * Both parts are stored separately, see persistent_storage_layout.
+ */
+struct station_timing: station_bus_timing, station_slot_timing {
+	constexpr static int MAX_FRAME_TIMEOUT_US{200000};
+
+	static station_timing& Default() {
+		static station_timing t{};
+		return t;
+	}
+	/** @brief writes the station timing as json to the static string s */
+	template<int N>
+	constexpr int dump_to_json(static_string<N> &s) const {
+		return s.append_formatted(R"({{"pipelined":{},"frame_timeouts_us":[{},{},{},{},{}],"frame_gap_us":{},"buses":{},"feeds_per_slot":{},"hw_timer":{}}})", 
+		     pipelined, frame_timeouts_us[p0], frame_timeouts_us[p1], frame_timeouts_us[p2], frame_timeouts_us[feed], frame_timeouts_us[p3], frame_gap_us, buses, feeds_per_slot, hw_timer);
+	}
+	constexpr bool parse_from_json(std::string_view json) {
+		JSON_ASSERT(json.size() && json[0] == '{', "Invalid json, missing start of object");
+		json = json.substr(1);
+		for(int i = 0; i < 64 && json.size(); ++i) {
+			auto key = parse_remove_json_string(json);
+			JSON_ASSERT(key, "Error parsing the key");
+			JSON_ASSERT(json.size() && json[0] == ':', "Invalid json, missing ':' after key");
+			json = json.substr(1);
+			if (key == "pipelined") {
+				std::optional<double> r = parse_remove_json_double(json);
+				JSON_ASSERT(r, "Error parsing pipelined");
+				pipelined = r.value();
+			} else if (key == "frame_timeouts_us") {
+				bool parsed = parse_remove_json_double_array(json, frame_timeouts_us);
+				JSON_ASSERT(parsed, "Error parsing frame_timeouts_us");
+			} else if (key == "frame_gap_us") {
+				std::optional<double> r = parse_remove_json_double(json);
+				JSON_ASSERT(r, "Error parsing frame_gap_us");
+				frame_gap_us = r.value();
+			} else if (key == "buses") {
+				std::optional<double> r = parse_remove_json_double(json);
+				JSON_ASSERT(r, "Error parsing buses");
+				buses = r.value();
+			} else if (key == "feeds_per_slot") {
+				std::optional<double> r = parse_remove_json_double(json);
+				JSON_ASSERT(r, "Error parsing feeds_per_slot");
+				feeds_per_slot = r.value();
+			} else if (key == "hw_timer") {
+				std::optional<double> r = parse_remove_json_double(json);
+				JSON_ASSERT(r, "Error parsing hw_timer");
+				hw_timer = r.value();
+			} else {
+				LogError("Invalid key {}", key.value());
+				return false;
+			}
+			JSON_ASSERT(json.size(), "Invalid json, missing character after value");
+			if (json[0] == '}')
+				break;
+			JSON_ASSERT(json[0] == ',', "Invalid json, expected ',' after value");
+			json = json.substr(1);
+		}
+		return true;
+	}
+	/** @brief resets out of range values (eg. from erased flash) to their defaults, returns true if something changed */
+	constexpr bool sanitize() {
+		constexpr station_timing d{};
+		bool change{};
+		if (pipelined != 0 && pipelined != 1) {
+			pipelined = d.pipelined;
+			change = true;
+		}
+		// a frame blocks the bus task for its timeout in the fixed profile, which has to stay well below the 500 ms watchdog
+		for (int i = 0; i < COUNT; ++i) {
+			if (frame_timeouts_us[i] >= 1000 && frame_timeouts_us[i] <= MAX_FRAME_TIMEOUT_US)
+				continue;
+			frame_timeouts_us[i] = d.frame_timeouts_us[i];
+			change = true;
+		}
+		if (frame_gap_us < 0 || frame_gap_us > 100000) {
+			frame_gap_us = d.frame_gap_us;
+			change = true;
+		}
+		if (buses < 1 || buses > 2) {
+			buses = d.buses;
+			change = true;
+		}
+		if (feeds_per_slot < 1 || feeds_per_slot > 16) {
+			feeds_per_slot = d.feeds_per_slot;
+			change = true;
+		}
+		if (hw_timer != 0 && hw_timer != 1) {
+			hw_timer = d.hw_timer;
+			change = true;
+		}
+		return change;
+	}
+};
+
+/** @brief prints formatted for monospace output, eg. usb */
+std::ostream& operator<<(std::ostream &os, const station_timing &t) {
+	os << "pipelined " << t.pipelined << '\n';
+	os << "frame_timeouts_us";
+	for (int timeout: t.frame_timeouts_us)
+		os << ' ' << timeout;
+	os << '\n';
+	os << "frame_gap_us " << t.frame_gap_us << '\n';
+	os << "buses " << t.buses << '\n';
+	os << "feeds_per_slot " << t.feeds_per_slot << '\n';
+	os << "hw_timer " << t.hw_timer << '\n';
+	return os;
+}
+
+/** @brief parses a single key, value pair from the istream */
+std::istream& operator>>(std::istream &is, station_timing &t) {
+	std::string key;
+	is >> key;
+	if (key == "pipelined")
+		is >> t.pipelined;
+	else if (key == "frame_timeouts_us")
+		for (int &timeout: t.frame_timeouts_us)
+			is >> timeout;
+	else if (key == "frame_gap_us")
+		is >> t.frame_gap_us;
+	else if (key == "buses")
+		is >> t.buses;
+	else if (key == "feeds_per_slot")
+		is >> t.feeds_per_slot;
+	else if (key == "hw_timer")
+		is >> t.hw_timer;
+	else
+		is.setstate(std::ios_base::failbit);
+	if (is)
+		t.sanitize();
+	return is;
+}
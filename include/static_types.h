@@ -1,8 +1,11 @@
 #pragma once
 
 #include <array>
+#include <bit>
 #include <string_view>
 #include <format>
+#include <new>
+#include <type_traits>
 
 template<int N, typename size_type = int>
 struct static_string {
@@ -64,6 +67,7 @@ struct static_vector {
 	constexpr const T* begin() const { return storage.begin(); }
 	constexpr const T* end() const { return storage.begin() + cur_size; }
 	constexpr T& operator[](size_type i) { return storage[i]; }
+	constexpr const T& operator[](size_type i) const { return storage[i]; }
 	constexpr T* push() { if (cur_size >= N) return {}; return storage.data() + cur_size++; }
 	constexpr bool push(const T& e) { if (cur_size == N) return false; storage[cur_size++] = e; return true; }
 	constexpr bool push(T&& e) { if (cur_size == N) return false; storage[cur_size++] = std::move(e); return true; }
@@ -113,6 +117,87 @@ struct static_ring_buffer {
 	};
 };
 
+/**
+ * @brief Open addressing hash map with linear probing for small integral keys.
+ * N has to be a power of 2, at max N - 1 elements can be stored.
+ * Erasing uses backward shifting, so no tombstones accumulate over time.
+ */
+template<typename K, typename V, int N>
+struct static_hash_map {
+	static_assert(std::has_single_bit(unsigned(N)), "N has to be a power of 2");
+	struct entry { K key{}; V value{}; bool used{}; };
+	std::array<entry, N> storage{};
+	int cur_size{};
+	constexpr V* find(const K &k) { int i = _find_idx(k); return i < 0 ? nullptr: &storage[i].value; }
+	constexpr const V* find(const K &k) const { int i = _find_idx(k); return i < 0 ? nullptr: &storage[i].value; }
+	/** @brief inserts or overwrites the value for key k, returns false if the map is full */
+	constexpr bool insert(const K &k, const V &v) {
+		for (uint32_t i = _slot(k), c = 0; c < N; i = (i + 1) % N, ++c) {
+			if (storage[i].used && storage[i].key != k)
+				continue;
+			if (!storage[i].used && cur_size >= N - 1)
+				return false;
+			cur_size += !storage[i].used;
+			storage[i] = entry{k, v, true};
+			return true;
+		}
+		return false;
+	}
+	constexpr bool erase(const K &k) {
+		int i = _find_idx(k);
+		if (i < 0)
+			return false;
+		storage[i].used = false;
+		--cur_size;
+		// shift back all following entries of the cluster which would not be found anymore
+		for (int j = (i + 1) % N; storage[j].used; j = (j + 1) % N) {
+			int h = _slot(storage[j].key);
+			bool movable = i <= j ? (h <= i || h > j): (h <= i && h > j);
+			if (!movable)
+				continue;
+			storage[i] = storage[j];
+			storage[j].used = false;
+			i = j;
+		}
+		return true;
+	}
+	constexpr void clear() { for (auto &e: storage) e.used = false; cur_size = 0; }
+	constexpr bool empty() const { return cur_size == 0; }
+	constexpr int size() const { return cur_size; }
+	/*INTERNAL*/ static constexpr uint32_t _slot(const K &k) { return (uint32_t(k) * 2654435761u) >> (33 - std::bit_width(unsigned(N))); }
+	/*INTERNAL*/ constexpr int _find_idx(const K &k) const {
+		for (uint32_t i = _slot(k), c = 0; c < N && storage[i].used; i = (i + 1) % N, ++c)
+			if (storage[i].key == k)
+				return i;
+		return -1;
+	}
+};
+
+/**
+ * @brief Replacement for std::function which stores the callable in place instead of on the heap.
+ * Only trivially copyable callables up to N bytes are accepted (function pointers and lambdas capturing
+ * references or views), so copying is a plain memberwise copy.
+ * Like std::function mutable lambdas can be stored, they keep their state in the static_function.
+ */
+template<typename Sig, int N = 6 * sizeof(void*)>
+struct static_function;
+template<int N, typename R, typename... Args>
+struct static_function<R(Args...), N> {
+	alignas(void*) mutable std::array<std::byte, N> storage{};
+	R (*invoke)(void *f, Args... args){};
+
+	constexpr static_function() = default;
+	template<typename F> requires (!std::is_same_v<std::decay_t<F>, static_function> && std::is_invocable_r_v<R, F&, Args...>)
+	static_function(F f) {
+		static_assert(sizeof(F) <= N, "Callable too big for static_function, increase N");
+		static_assert(std::is_trivially_copyable_v<F> && std::is_trivially_destructible_v<F>, "static_function only accepts trivially copyable callables");
+		new (storage.data()) F(f);
+		invoke = [](void *f, Args... args) -> R { return (*static_cast<F*>(f))(std::forward<Args>(args)...); };
+	}
+	R operator()(Args... args) const { return invoke(storage.data(), std::forward<Args>(args)...); }
+	constexpr explicit operator bool() const { return invoke; }
+};
+
 template<int N, typename... Args>
 static std::string_view static_format(std::format_string<Args...> fmt, Args&&... args) {
 	static static_string<N> string{};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string_view>
 
 /** @brief Extract a word from the beginning of content, never reading over newlines.
@@ -51,6 +52,25 @@ constexpr void skip_whitespace(std::string_view &content) {
 	content = content.substr(std::min(content.size(), content.find_first_not_of(" \t\n\v\r\f")));
 }
 
+/** @brief case insensitive comparison of ascii strings, eg. for http header values */
+constexpr bool iequals(std::string_view a, std::string_view b) {
+	const auto lower = [](char c) { return c >= 'A' && c <= 'Z' ? char(c + ('a' - 'A')): c; };
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i)
+		if (lower(a[i]) != lower(b[i]))
+			return false;
+	return true;
+}
+
+/** @brief 32 bit fnv-1a hash, used for ram indices over short strings */
+constexpr uint32_t fnv1a(std::string_view s) {
+	uint32_t h{2166136261u};
+	for (char c: s)
+		h = (h ^ uint8_t(c)) * 16777619u;
+	return h;
+}
+
 constexpr bool is_quote(char c) { return c == '"' || c == '\''; }
 
 template<typename T, unsigned int N>
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <functional>
 #include <atomic>
 
 #include "string_util.h"
@@ -20,19 +19,25 @@
 constexpr std::string_view HTTP_VERSION{"HTTP/1.1"};
 
 constexpr std::string_view STATUS_OK{"200 OK"};
+constexpr std::string_view STATUS_NOT_MODIFIED{"304 Not Modified"};
 constexpr std::string_view STATUS_BAD_REQUEST{"400 Bad Request"};
 constexpr std::string_view STATUS_UNAUTHORIZED{"401 Unauthorized"};
 constexpr std::string_view STATUS_FORBIDDEN{"403 Forbidden"};
 constexpr std::string_view STATUS_NOT_FOUND{"404 Not Found"};
+constexpr std::string_view STATUS_PAYLOAD_TOO_LARGE{"413 Payload Too Large"};
 constexpr std::string_view STATUS_INTERNAL_SERVER_ERROR{"500 Internal Server Error"};
+constexpr std::string_view STATUS_SERVICE_UNAVAILABLE{"503 Service Unavailable"};
 
 constexpr std::string_view DEFAULT_SERVER{"LacheiEmbed(josefstumpfegger@outlook.de)"};
 
 constexpr std::string_view CONTENT_TEXT{"text/plain"};
 constexpr std::string_view CONTENT_JSON{"application/json"};
+constexpr std::string_view CONTENT_NDJSON{"application/x-ndjson"};
 
 struct EndpointFlags{
 	bool path_match: 1 {true}; // path for endpoint has to match, not only 
+	bool stream_body: 1 {false}; // callback is called for every recieved part of the body (see message_buffer::body_remaining), the response is sent after the last part.
+	                             // Only the first call has method, path and headers set. If the connection is lost the last call has an empty body
 };
 
 struct header {
@@ -54,9 +59,16 @@ struct headers {
 
 /** @brief Tcp server that serves text data according to path specification.
   * The returned content can be freely configured via callbacks via callbacks 
-  * @note The tcp server instantly discards any connection after the response was sent.*/
+  * @note Connections are persistent (http/1.1 keep-alive): they stay open until the client closes them, sends
+  * Connection: close (or is http/1.0 without Connection: keep-alive), a response has no length, or no request
+  * came for keep_alive_s. Pipelined requests are answered in order, if all client slots are used the longest
+  * idle connection is closed for a new one.
+  * Requests spanning several tcp segments are assembled in a recieve buffer of the client until the head and the body are
+  * complete. Bodies larger than a buffer are only accepted by stream_body endpoints, which get them part by part.*/
 template<int get_size, int post_size, int put_size = 0, int delete_size = 0, int max_path_length = 256, int max_headers = 32, int buf_size = 6144, int message_buffers = 4>
 struct tcp_server {
+	struct endpoint;
+	static constexpr int buffer_size{buf_size};
 	/**
 	 * @brief Struct with a full http frame for both sending and recieving.
 	 * The struct has only 1 member, the `buffer` which really holds information,
@@ -77,6 +89,22 @@ struct tcp_server {
 
 		tcp_server *parent_server{};
 
+		// streaming of large request bodies and responses, the buffers stay reserved for the client until done
+		uint32_t body_remaining{}; // request: body bytes of a stream_body endpoint not yet recieved, 0 on the last call
+		bool stream_aborted{}; // request: the last call of a stream_body endpoint is because the client went away before the body was complete
+		const endpoint *stream_endpoint{}; // request: endpoint recieving the remaining body parts
+		message_buffer *stream_response{}; // request: response buffer which is sent after the last body part
+		/** @brief response: if set by the endpoint it is called to append the next part of the response to the
+		  * (then empty) buffer whenever the client can take more data, returns false after the last part */
+		static_function<bool(message_buffer &res)> stream_cb{};
+		bool streaming{}; // response: buffer is sent paced by the tcp sent callback
+		std::string_view static_body{}; // response: rest of the body, sent by reference after the buffer, see res_write_static_body()
+		uint32_t stream_pos{}; // response: bytes of buffer already handed to tcp
+		int idle_polls{}; // polls without progress while streaming, the client is dropped after 2
+		bool assembling{}; // request: head or body not complete yet, the next segments of tpcb are appended
+		bool close_connection{}; // response: the connection is closed after the response, written as Connection header by res_set_status_line()
+		bool framed{}; // response: has a Content-Length or Transfer-Encoding header, else only closing the connection ends it
+
 		// ------------------------------------------------------
 		// request functions
 		// ------------------------------------------------------
@@ -100,13 +128,21 @@ struct tcp_server {
 		/** @brief writes the string_view the end of the backing buffer directly after the header section
 		  * and sets the internal body variable to exactly this string */
 		void res_write_body(std::string_view body = {});
-		void clear() { used = {}; buffer.clear(); method = {}; path = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; tpcb = {}; on_stream_out = {}; }
+		/** @brief ends the header section, the body is handed to tcp by reference after the buffer without being copied.
+		  * The data has to stay valid until the client acked it, eg. constants in flash */
+		void res_write_static_body(std::string_view body) { res_write_body(); static_body = body; }
+		void clear() { used = {}; buffer.clear(); method = {}; path = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; tpcb = {}; on_stream_out = {}; 
+			body_remaining = {}; stream_aborted = {}; stream_endpoint = {}; stream_response = {}; stream_cb = {}; streaming = {}; stream_pos = {}; static_body = {}; idle_polls = {};
+			assembling = {}; close_connection = {}; framed = {}; }
 	};
-	using endpoint_callback = std::function<void(const message_buffer &request, message_buffer& response)>;
+	using endpoint_callback = static_function<void(const message_buffer &request, message_buffer& response)>;
+	/** @brief path points to a string literal, path_hash is computed on construction so that exact
+	  * matches are rejected by a single integer comparison */
 	struct endpoint {
 		EndpointFlags flags;
-		std::array<char, 256> path;
+		std::string_view path;
 		endpoint_callback callback;
+		uint32_t path_hash{fnv1a(path)};
 	};
 
 	int port{80};
@@ -116,6 +152,24 @@ struct tcp_server {
 	std::array<endpoint, put_size> put_endpoints{};
 	std::array<endpoint, delete_size> delete_endpoints{};
 	int poll_time_s{5};
+	int keep_alive_s{15}; // persistent connections without request for this long are closed, checked every poll_time_s
+
+	/** @brief state of a persistent connection, index equal to its client_pcbs slot, set as tcp_arg of the client */
+	struct client_state {
+		tcp_server *server{};
+		int idle_s{}; // time since the last traffic, counted in poll_time_s steps
+		uint32_t requests{}; // requests recieved on the connection
+		uint16_t rx_consumed{}; // bytes of a pbuf already processed when it was refused to wait for a streamed response
+		bool close{}; // close after the current response
+		bool aborted{}; // the pcb was aborted when closing, lwIP callbacks have to return ERR_ABRT
+	};
+	struct connection_stats {
+		uint32_t opened{}; // accepted connections
+		uint32_t reused{}; // requests recieved on a connection which already had a request
+		uint32_t timed_out{}; // connections closed after keep_alive_s without request
+		uint32_t evicted{}; // idle connections closed to accept a new one
+	};
+	connection_stats conn_stats{};
 
 	~tcp_server() { if(!closed) LogError("Tcp server not closed before destruction!"); };
 	err_t start();
@@ -126,11 +180,31 @@ struct tcp_server {
 	std::array<std::atomic<struct tcp_pcb*>, message_buffers> client_pcbs{}; // each client has 1 send and recieve buffer for itself
 	std::array<message_buffer, message_buffers> send_buffers{};
 	std::array<message_buffer, message_buffers> recieve_buffers{};
+	std::array<client_state, message_buffers> clients{};
 	int sent_len{};
 	int recv_len{};
 	int run_count{};
 
+	/** @brief appends the request starting at offset of p to the recieve buffer assembling the request of the client
+	  * (or a free one) and processes it once complete or once the buffer is full
+	  * @returns the bytes of p used by the request, 0 if it could not be processed */
+	uint32_t recieve_request(struct pbuf *p, uint32_t offset, struct tcp_pcb *client);
 	void process_request(uint32_t recieve_buffer_idx, struct tcp_pcb *client);
+	/** @brief hands the next body part of a stream_body request starting at offset of p to its endpoint
+	  * @returns the offset after the used bytes */
+	uint32_t continue_recieve_stream(message_buffer &recieve_buffer, struct pbuf *p, uint32_t offset = 0);
+	/** @brief sends the response (or starts streaming it) and frees the buffers */
+	void finish_request(message_buffer &recieve_buffer, message_buffer &send_buffer, struct tcp_pcb *client);
+	/** @brief writes as much of a streamed response (stream_cb or static_body) as fits into the tcp send buffer, called again from the sent callback */
+	err_t pump_stream(message_buffer &send_buffer);
+	/** @returns the buffer of the client which is currently recieving/sending a stream, nullptr if none */
+	message_buffer* find_stream(struct tcp_pcb *client, bool recieve);
+	/** @brief frees all buffers reserved for streams of the client, a recieving endpoint is called a last time with stream_aborted set */
+	void release_client_buffers(struct tcp_pcb *client);
+	/** @brief slot of the client in client_pcbs and clients, -1 if not connected */
+	int client_slot(struct tcp_pcb *client) const;
+	/** @brief frees the buffers of the client and closes its connection, already queued data is still sent */
+	err_t close_client(struct tcp_pcb *client);
 	err_t send_data(std::string_view data, struct tcp_pcb *client);
 };
 
@@ -159,6 +233,18 @@ constexpr static err_t clear_client_pcb(std::atomic<struct tcp_pcb*> &pcb) {
 
 }
 
+/** @returns the length of the http request at the start of data (head and the body given by Content-Length),
+  * 0 if the head is incomplete. The body might be longer than data */
+constexpr static uint32_t request_length(std::string_view data) {
+	size_t head_end = data.find("\r\n\r\n");
+	if (head_end == std::string_view::npos)
+		return 0;
+	const std::string_view content_length_key{"\r\nContent-Length:"};
+	size_t content_length = data.substr(0, head_end + 2).find(content_length_key);
+	uint32_t body_size = content_length == std::string_view::npos ? 0: strtoul(data.data() + content_length + content_length_key.size(), nullptr, 10);
+	return head_end + 4 + body_size;
+}
+
 template template_args
 constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *client) {
 	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
@@ -171,60 +257,110 @@ constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *
 	for (auto &pcb: server.client_pcbs) {
 		if (pcb == nullptr || (client && pcb != client))
 			continue;
+		server.release_client_buffers(pcb);
 		err = clear_client_pcb(pcb);
+		server.clients[&pcb - server.client_pcbs.data()].aborted = err == ERR_ABRT;
 	}
 	return err;
 }
 
 template template_args
 constexpr static err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+	if (!arg)
+		return ERR_OK;
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	client.idle_s = 0;
+	if (auto *stream = server.find_stream(tpcb, false)) {
+		err_t err = server.pump_stream(*stream);
+		if (err != ERR_OK || server.find_stream(tpcb, false) || !client.close)
+			return err;
+		return server.close_client(tpcb); // last part of the streamed response handed to tcp
+	}
 	return ERR_OK;
 }
 
 
 template template_args
 constexpr static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-	if (!p || !arg) {
+	if (!arg) {
 		LogError("tcp_server_recv() failed");
-		return tcp_server_result template_args_pure(arg, -1, tpcb);
+		if (p)
+			pbuf_free(p);
+		return ERR_OK;
 	}
-	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
-	if (p->tot_len > buf_size)
-		LogError("Message too big, could not recieve");
-	else if (p->tot_len > 0) {
-		// Receive the buffer
-		int recieve_buffer{-1};
-		bool recieve_success{};
-		for (auto &buffer: server.recieve_buffers) {
-			++recieve_buffer;
-			if (buffer.used.exchange(true))
-				continue;
-			buffer.buffer.set_size(pbuf_copy_partial(p, buffer.buffer.data(), p->tot_len, 0));
-			server.process_request(recieve_buffer, tpcb);
-			recieve_success = true;
-			break;
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	if (!p) {
+		LogInfo("Client closed the connection");
+		return server.close_client(tpcb);
+	}
+	client.idle_s = 0;
+	// an endpoint or a failed send might have closed the client, then tpcb is not to be used anymore
+	const auto closed = [&server, tpcb] { return server.client_slot(tpcb) < 0; };
+	for (uint32_t offset = client.rx_consumed; offset < p->tot_len;) {
+		if (auto *stream = server.find_stream(tpcb, true)) {
+			offset = server.continue_recieve_stream(*stream, p, offset);
+			if (closed())
+				break;
+			continue;
+		}
+		if (client.close)
+			break; // nothing is answered after Connection: close
+		// pipelined request while the last response is still streamed out, lwIP delivers the refused pbuf again later
+		if (server.find_stream(tpcb, false)) {
+			client.rx_consumed = offset;
+			return ERR_MEM;
 		}
-		if (!recieve_success)
-			LogError("Could not recieve message, no free recieve buffer");
+		uint32_t used = server.recieve_request(p, offset, tpcb);
+		if (!used || closed())
+			break;
+		offset += used;
 	}
+	client.rx_consumed = 0;
+	uint16_t recieved = p->tot_len;
 	pbuf_free(p);
+	if (closed())
+		return client.aborted ? ERR_ABRT: ERR_OK;
+	tcp_recved(tpcb, recieved);
+	if (client.close && !server.find_stream(tpcb, true) && !server.find_stream(tpcb, false))
+		return server.close_client(tpcb);
 	return ERR_OK;
 }
 
 template template_args
 constexpr static err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb) {
+	if (!arg)
+		return ERR_OK;
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	// keep clients which are streaming and made progress since the last polls
+	auto *stream = server.find_stream(tpcb, true);
+	if (!stream)
+		stream = server.find_stream(tpcb, false);
+	if (stream && stream->idle_polls++ < 2)
+		return ERR_OK;
+	// keep idle persistent connections until keep_alive_s
+	if (!stream && (client.idle_s += server.poll_time_s) < server.keep_alive_s)
+		return ERR_OK;
+	if (!stream)
+		++server.conn_stats.timed_out;
 	// remove connections that are not anymore valid
 	LogInfo("tcp_server_poll_fn");
-	return tcp_server_result template_args_pure(arg, -1, tpcb); // on no response remove the client to free up space
+	return server.close_client(tpcb); // on no response remove the client to free up space
 }
 
 template template_args
 constexpr static void tcp_server_err(void *arg, err_t err) {
 	LogError("tcp_server_err {}", err);
-	if (err != ERR_ABRT) {
-		LogError("tcp_client_err_fn {}", err);
-		tcp_server_result template_args_pure(arg, err, nullptr);
-	}
+	if (!arg)
+		return;
+	// the pcb is already freed by lwIP, only the slot is released
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	auto &pcb = server.client_pcbs[&client - server.clients.data()];
+	server.release_client_buffers(pcb);
+	pcb = nullptr;
 }
 
 template template_args
@@ -248,6 +384,25 @@ constexpr static err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb,
 			break;
 	}
 
+	if (!found_empty_spot) {
+		// close the longest idle persistent connection without a running stream
+		int evict{-1};
+		for (int j = 0; j < int(server.client_pcbs.size()); ++j) {
+			struct tcp_pcb *pcb = server.client_pcbs[j];
+			if (!pcb || server.find_stream(pcb, true) || server.find_stream(pcb, false))
+				continue;
+			if (evict < 0 || server.clients[j].idle_s > server.clients[evict].idle_s)
+				evict = j;
+		}
+		if (evict >= 0) {
+			LogInfo("All clients connected, closing idle client {}", evict + 1);
+			++server.conn_stats.evicted;
+			server.close_client(server.client_pcbs[evict]);
+			struct tcp_pcb *null{};
+			found_empty_spot = server.client_pcbs[evict].compare_exchange_strong(null, client_pcb);
+			i = evict + 1;
+		}
+	}
 	if (!found_empty_spot) {
 		LogError("All clients already connected, refusing");
 		err = tcp_close(client_pcb);
@@ -260,8 +415,10 @@ constexpr static err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb,
 	}
 
 	LogInfo("Client connected on id {}, setting up callbacks", i);
+	++server.conn_stats.opened;
+	server.clients[i - 1] = {.server = &server};
 	
-	tcp_arg(client_pcb, arg);
+	tcp_arg(client_pcb, &server.clients[i - 1]);
 	tcp_sent(client_pcb, tcp_server_sent template_args_pure);
 	tcp_recv(client_pcb, tcp_server_recv template_args_pure);
 	tcp_poll(client_pcb, tcp_server_poll template_args_pure, server.poll_time_s * 2);
@@ -327,6 +484,11 @@ void tcp_server template_args_pure::message_buffer::res_set_status_line(std::str
 	buffer.append_formatted("{} {}\r\n", http_version, status);
 	this->http_version = buffer.sv();
 	this->status = buffer.sv();
+	if (parent_server) {
+		res_add_header("Connection", close_connection ? "close": "keep-alive");
+		if (!close_connection)
+			res_add_header("Keep-Alive", static_format<24>("timeout={}", parent_server->keep_alive_s));
+	}
 }
 
 template template_args
@@ -341,6 +503,7 @@ header tcp_server template_args_pure::message_buffer::res_add_header(std::string
 		LogWarning("res_add_header() body.size() != 0, is reset");
 	}
 
+	framed |= key == "Content-Length" || key == "Transfer-Encoding";
 	int s = buffer.size();
 	buffer.append_formatted("{}: {}\r\n", key, value);
 	if (!this->headers_view.headers.push(header{buffer.sv().substr(s), buffer.sv().substr(s + key.size() + 2)})) {
@@ -427,6 +590,41 @@ err_t tcp_server template_args_pure::stop() {
 }
 
 
+template template_args
+uint32_t tcp_server template_args_pure::recieve_request(struct pbuf *p, uint32_t offset, struct tcp_pcb *client) {
+	int idx{};
+	for (; idx < int(recieve_buffers.size()); ++idx)
+		if (recieve_buffers[idx].used && recieve_buffers[idx].assembling && recieve_buffers[idx].tpcb == client)
+			break;
+	if (idx == int(recieve_buffers.size()))
+		for (idx = 0; idx < int(recieve_buffers.size()) && recieve_buffers[idx].used.exchange(true); ++idx);
+	if (idx == int(recieve_buffers.size())) {
+		LogError("Could not recieve message, no free recieve buffer");
+		return 0;
+	}
+	auto &recieve_buffer = recieve_buffers[idx];
+	// one byte is kept free for the terminating 0 of req_update_structured_views()
+	uint32_t before = recieve_buffer.buffer.size();
+	uint32_t copied = pbuf_copy_partial(p, recieve_buffer.buffer.data() + before, std::min<uint32_t>(p->tot_len - offset, buf_size - 1 - before), offset);
+	recieve_buffer.buffer.set_size(before + copied);
+	uint32_t length = tcp_server_internal::request_length(recieve_buffer.buffer.sv());
+	uint32_t size = recieve_buffer.buffer.size();
+	if ((length == 0 || length > size) && size < buf_size - 1) {
+		recieve_buffer.assembling = true; // wait for the next segment
+		recieve_buffer.tpcb = client;
+		return copied;
+	}
+	if (length == 0) {
+		LogError("Request head too big, could not recieve");
+		recieve_buffer.clear();
+		return 0;
+	}
+	recieve_buffer.assembling = false;
+	recieve_buffer.buffer.set_size(std::min(length, size));
+	process_request(idx, client);
+	return std::min(length, size) - before;
+}
+
 template template_args
 void tcp_server template_args_pure::process_request(uint32_t recieve_buffer_idx, struct tcp_pcb *client) {
 	if (recieve_buffer_idx >= recieve_buffers.size()) {
@@ -439,7 +637,19 @@ void tcp_server template_args_pure::process_request(uint32_t recieve_buffer_idx,
 	// the following also atomically reservers a buffer
 	for (; (uint32_t)free_send_idx < send_buffers.size() && send_buffers[free_send_idx].used.exchange(true) ; ++free_send_idx);
 	if ((uint32_t)free_send_idx >= send_buffers.size()) {
-		LogError("No free buffer for sending found, dropping request");
+		// answered from the recieve buffer, else a keep-alive client waits for a response until it times out
+		LogError("No free buffer for sending found, answering 503");
+		if (int slot = client_slot(client); slot >= 0)
+			clients[slot].close = true; // a not yet recieved body is skipped by closing
+		recieve_buffer.clear();
+		recieve_buffer.parent_server = this;
+		recieve_buffer.close_connection = true;
+		recieve_buffer.res_set_status_line(HTTP_VERSION, STATUS_SERVICE_UNAVAILABLE);
+		recieve_buffer.res_add_header("Server", DEFAULT_SERVER);
+		recieve_buffer.res_add_header("Retry-After", "1");
+		recieve_buffer.res_add_header("Content-Length", "0");
+		recieve_buffer.res_write_body();
+		send_data(recieve_buffer.buffer.sv(), client);
 		recieve_buffer.clear();
 		return;
 	}
@@ -450,40 +660,201 @@ void tcp_server template_args_pure::process_request(uint32_t recieve_buffer_idx,
 
 	recieve_buffer.req_update_structured_views(); // parsing the recieve buffer
 
+	if (int slot = client_slot(client); slot >= 0) {
+		auto &state = clients[slot];
+		std::string_view connection = recieve_buffer.headers_view.get_header("Connection");
+		state.close = recieve_buffer.http_version == HTTP_VERSION ? iequals(connection, "close"): !iequals(connection, "keep-alive");
+		if (state.requests++)
+			++conn_stats.reused;
+		send_buffer.close_connection = state.close;
+	}
+
 	LogInfo("Processing request frame and generating result {} {}", recieve_buffer.method, recieve_buffer.path);
-	const auto prefixed_callback_call = [this, &recieve_buffer, &send_buffer](const auto &endpoints) {
-		for (const auto &[flags, prefix, callback]: endpoints) {
-			if ((flags.path_match && recieve_buffer.path == prefix.data()) ||
-			    (!flags.path_match && recieve_buffer.path.starts_with(prefix.data()))) {
-				callback(recieve_buffer, send_buffer);
-				return;
-			}
+	const uint32_t path_hash = fnv1a(recieve_buffer.path);
+	const auto find_endpoint = [&recieve_buffer, path_hash](const auto &endpoints) -> const endpoint* {
+		for (const endpoint &e: endpoints) {
+			if (e.flags.path_match ? e.path_hash == path_hash && e.path == recieve_buffer.path && e.callback:
+			                         recieve_buffer.path.starts_with(e.path))
+				return &e;
 		}
-		default_endpoint_cb(recieve_buffer, send_buffer);
+		return nullptr;
 	};
+	const endpoint *e{};
 	if (recieve_buffer.method == "GET") 
-		prefixed_callback_call(get_endpoints);
+		e = find_endpoint(get_endpoints);
 	else if (recieve_buffer.method == "POST") 
-		prefixed_callback_call(post_endpoints);
+		e = find_endpoint(post_endpoints);
 	else if (recieve_buffer.method == "PUT")
-		prefixed_callback_call(put_endpoints);
+		e = find_endpoint(put_endpoints);
 	else if (recieve_buffer.method == "DELETE")
-		prefixed_callback_call(delete_endpoints);
-	else
+		e = find_endpoint(delete_endpoints);
+
+	std::string_view content_length_header = recieve_buffer.headers_view.get_header("Content-Length");
+	uint32_t content_length = content_length_header.empty() ? 0: strtoul(content_length_header.data(), nullptr, 10);
+	if (recieve_buffer.body.size() < content_length && !(e && e->flags.stream_body)) {
+		// the rest of the body can not be recieved, it is skipped by closing the connection
+		LogError("Request body of {} bytes too big for {}", content_length, recieve_buffer.path);
+		if (int slot = client_slot(client); slot >= 0)
+			clients[slot].close = true;
+		send_buffer.close_connection = true;
+		send_buffer.res_set_status_line(HTTP_VERSION, STATUS_PAYLOAD_TOO_LARGE);
+		send_buffer.res_add_header("Server", DEFAULT_SERVER);
+		send_buffer.res_add_header("Content-Length", "0");
+		send_buffer.res_write_body();
+	} else if (!e) {
 		default_endpoint_cb(recieve_buffer, send_buffer);
+	} else if (e->flags.stream_body) {
+		if (recieve_buffer.body.size() > content_length)
+			recieve_buffer.body = recieve_buffer.body.substr(0, content_length);
+		recieve_buffer.body_remaining = content_length - recieve_buffer.body.size();
+		e->callback(recieve_buffer, send_buffer);
+		if (recieve_buffer.body_remaining) {
+			// the following segments of this client go to continue_recieve_stream()
+			recieve_buffer.stream_endpoint = e;
+			recieve_buffer.stream_response = &send_buffer;
+			recieve_buffer.tpcb = client;
+			return;
+		}
+	} else {
+		e->callback(recieve_buffer, send_buffer);
+	}
+	finish_request(recieve_buffer, send_buffer, client);
+}
 
-	send_data(send_buffer.buffer.sv(), client);
+template template_args
+uint32_t tcp_server template_args_pure::continue_recieve_stream(message_buffer &recieve_buffer, struct pbuf *p, uint32_t offset) {
+	recieve_buffer.method = {};
+	recieve_buffer.path = {};
+	recieve_buffer.headers_view.headers.clear();
+	recieve_buffer.idle_polls = 0;
+	while (offset < p->tot_len && recieve_buffer.body_remaining) {
+		uint32_t size = std::min<uint32_t>({uint32_t(p->tot_len - offset), uint32_t(buf_size), recieve_buffer.body_remaining});
+		recieve_buffer.buffer.set_size(pbuf_copy_partial(p, recieve_buffer.buffer.data(), size, offset));
+		offset += size;
+		recieve_buffer.body = recieve_buffer.buffer.sv();
+		recieve_buffer.body_remaining -= size;
+		recieve_buffer.stream_endpoint->callback(recieve_buffer, *recieve_buffer.stream_response);
+	}
+	if (recieve_buffer.body_remaining == 0)
+		finish_request(recieve_buffer, *recieve_buffer.stream_response, recieve_buffer.tpcb);
+	return offset;
+}
+
+template template_args
+void tcp_server template_args_pure::finish_request(message_buffer &recieve_buffer, message_buffer &send_buffer, struct tcp_pcb *client) {
 	recieve_buffer.clear();
+	if (int slot = client_slot(client); slot >= 0 && !send_buffer.framed)
+		clients[slot].close = true; // the client only sees the end of the response when the connection is closed
+	if (send_buffer.stream_cb || !send_buffer.static_body.empty()) {
+		send_buffer.tpcb = client;
+		send_buffer.streaming = true;
+		pump_stream(send_buffer);
+		return;
+	}
+	send_data(send_buffer.buffer.sv(), client);
 	send_buffer.clear();
 }
 
+template template_args
+err_t tcp_server template_args_pure::pump_stream(message_buffer &send_buffer) {
+	struct tcp_pcb *client = send_buffer.tpcb;
+	send_buffer.idle_polls = 0;
+	for (;;) {
+		if (send_buffer.stream_pos == uint32_t(send_buffer.buffer.size()) && !send_buffer.static_body.empty()) {
+			// no copy, lwIP reads the data (from flash) until it is acked
+			uint32_t size = std::min<uint32_t>(tcp_sndbuf(client), send_buffer.static_body.size());
+			if (size == 0)
+				break;
+			err_t err = tcp_write(client, send_buffer.static_body.data(), size, 0);
+			if (err == ERR_MEM)
+				break; // continued from the sent callback
+			if (err != ERR_OK) {
+				LogError("Failed to write static data {}", err);
+				return tcp_server_internal::tcp_server_result template_args_pure(this, -1, client);
+			}
+			send_buffer.static_body = send_buffer.static_body.substr(size);
+			continue;
+		}
+		if (send_buffer.stream_pos == uint32_t(send_buffer.buffer.size())) {
+			if (!send_buffer.stream_cb) {
+				send_buffer.clear(); // all parts handed to tcp, the buffer is free again
+				break;
+			}
+			send_buffer.buffer.clear();
+			send_buffer.stream_pos = 0;
+			if (!send_buffer.stream_cb(send_buffer))
+				send_buffer.stream_cb = {};
+			continue;
+		}
+		uint32_t size = std::min<uint32_t>(tcp_sndbuf(client), send_buffer.buffer.size() - send_buffer.stream_pos);
+		if (size == 0)
+			break;
+		err_t err = tcp_write(client, send_buffer.buffer.data() + send_buffer.stream_pos, size, TCP_WRITE_FLAG_COPY);
+		if (err == ERR_MEM)
+			break; // continued from the sent callback
+		if (err != ERR_OK) {
+			LogError("Failed to write stream data {}", err);
+			return tcp_server_internal::tcp_server_result template_args_pure(this, -1, client);
+		}
+		send_buffer.stream_pos += size;
+	}
+	return tcp_output(client);
+}
+
+template template_args
+tcp_server template_args_pure::message_buffer* tcp_server template_args_pure::find_stream(struct tcp_pcb *client, bool recieve) {
+	for (auto &buffer: recieve ? recieve_buffers: send_buffers)
+		if (buffer.used && buffer.tpcb == client && (recieve ? buffer.body_remaining > 0: buffer.streaming))
+			return &buffer;
+	return nullptr;
+}
+
+template template_args
+void tcp_server template_args_pure::release_client_buffers(struct tcp_pcb *client) {
+	if (auto *stream = find_stream(client, true)) {
+		stream->method = {};
+		stream->path = {};
+		stream->headers_view.headers.clear();
+		stream->body = {};
+		stream->body_remaining = 0;
+		stream->stream_aborted = true;
+		stream->stream_endpoint->callback(*stream, *stream->stream_response);
+		stream->stream_response->clear();
+		stream->clear();
+	}
+	if (auto *stream = find_stream(client, false))
+		stream->clear();
+	for (auto &buffer: recieve_buffers)
+		if (buffer.used && buffer.assembling && buffer.tpcb == client)
+			buffer.clear();
+}
+
+template template_args
+int tcp_server template_args_pure::client_slot(struct tcp_pcb *client) const {
+	for (int i = 0; i < int(client_pcbs.size()); ++i)
+		if (client && client_pcbs[i] == client)
+			return i;
+	return -1;
+}
+
+template template_args
+err_t tcp_server template_args_pure::close_client(struct tcp_pcb *client) {
+	int slot = client_slot(client);
+	if (slot < 0)
+		return ERR_OK;
+	release_client_buffers(client);
+	err_t err = tcp_server_internal::clear_client_pcb(client_pcbs[slot]);
+	clients[slot].aborted = err == ERR_ABRT;
+	return err;
+}
+
 template template_args
 err_t tcp_server template_args_pure::send_data(std::string_view data, struct tcp_pcb *client) {
 	int retry = 10; // give 10 retries
 	while (data.size()) {
 		uint32_t free_space = std::min<uint32_t>(tcp_sndbuf(client), data.size());
 
-		err_t err = tcp_write(client, data.data(), free_space, 0);
+		err_t err = tcp_write(client, data.data(), free_space, TCP_WRITE_FLAG_COPY); // the buffer is reused right away
 		if (err != ERR_OK) {
 			LogWarning("Failed to write data {}, retries left {}", err, retry);
 			if (--retry > 0) {
@@ -1,17 +1,117 @@
 #pragma once
 
+#include <atomic>
+#include <bit>
+#include <span>
+#include <limits>
 #include <FreeRTOS.h>
+#include <task.h>
 #include "pico/stdlib.h"
+#include "hardware/irq.h"
 #include "static_types.h"
+#include "log_storage.h"
 
-template <int RX, int TX, int UART_ID = 0, int BAUD_RATE = 9600, int DATA_BITS = 7, int STOP_BITS = 1, uart_parity_t PARITY = UART_PARITY_EVEN> 
+/**
+ * @brief One shot recording of the traffic on a uart with the time of every byte, filled until full or stopped.
+ * Only written by the task using the uart (tx bytes in puts(), rx bytes when they are popped), read out with the usb trace command.
+ */
+template<int N = 256>
+struct uart_trace {
+	struct entry {
+		uint32_t time{}; // lower 32 bit of time_us_64()
+		char data{};
+		bool tx{};
+	};
+	static_vector<entry, N> entries{};
+	bool active{};
+
+	void start() { entries.clear(); active = true; }
+	void stop() { active = false; }
+	void record(uint64_t time, char data, bool tx) {
+		if (active && !entries.push(entry{.time = uint32_t(time), .data = data, .tx = tx}))
+			active = false;
+	}
+};
+
+/**
+ * @brief Histogram of the deviation of frame transmissions from their scheduled time,
+ * bucket i counts deviations below (16 << i) us, the last bucket all larger ones.
+ */
+struct jitter_histogram {
+	constexpr static int BUCKETS{12};
+	std::array<uint32_t, BUCKETS> buckets{};
+	uint32_t max_us{};
+	uint32_t early{}; // frames sent before their time
+
+	void add(int64_t deviation_us) {
+		if (deviation_us < 0)
+			++early;
+		uint32_t d = uint32_t(std::min<uint64_t>(deviation_us < 0 ? -deviation_us: deviation_us, std::numeric_limits<uint32_t>::max()));
+		max_us = std::max(max_us, d);
+		++buckets[std::min(int(std::bit_width(d >> 4)), BUCKETS - 1)];
+	}
+	/** @brief writes the histogram as json object to the static string s */
+	template<int N>
+	int dump_to_json(static_string<N> &s) const {
+		int write_size = s.append_formatted(R"({{"max_us":{},"early":{},"buckets_us":[)", max_us, early);
+		for (int i = 0; i < BUCKETS; ++i)
+			write_size += s.append_formatted(R"({}[{},{}])", i ? ",": "", 16 << i, buckets[i]);
+		return write_size + s.append_formatted("]}}");
+	}
+};
+
+/** @brief prints formatted for monospace output, eg. usb */
+std::ostream& operator<<(std::ostream &os, const jitter_histogram &h) {
+	os << "max " << h.max_us << " us, early " << h.early << '\n';
+	for (int i = 0; i < h.BUCKETS; ++i)
+		os << (i == h.BUCKETS - 1 ? "   >= ": "    < ") << (16 << (i == h.BUCKETS - 1 ? i - 1: i)) << " us: " << h.buckets[i] << '\n';
+	return os;
+}
+
+/**
+ * @brief Uart with an interrupt driven receive path.
+ * The rx interrupt moves every byte together with its arrival time into a ring buffer,
+ * the consumer drains the buffer in bulk via pop() and is only woken up (task notification)
+ * when a complete frame arrived, see expect_frame().
+ * Frames are sent by the tx interrupt, either right away (puts()) or at a given time with microsecond
+ * precision (puts_at()), where a hardware alarm starts the transmission. Both return without waiting for it.
+ */
+template <int RX, int TX, int UART_ID = 0, int BAUD_RATE = 9600, int DATA_BITS = 7, int STOP_BITS = 1, uart_parity_t PARITY = UART_PARITY_EVEN, int RX_BUFFER_SIZE = 64> 
 struct uart_connection {
+	static_assert(std::has_single_bit(unsigned(RX_BUFFER_SIZE)), "RX_BUFFER_SIZE has to be a power of 2");
+	constexpr static uint32_t CHAR_TIME_US{(1 + DATA_BITS + (PARITY != UART_PARITY_NONE) + STOP_BITS) * 1000000 / BAUD_RATE}; // start, data, parity and stop bits
 	static uart_connection& Default() {
 		static uart_connection uart;
 		return uart;
 	}
 
+	struct rx_byte {
+		uint64_t time{}; // time_us_64() when the byte was recieved
+		char data{};
+	};
+
 	uart_inst_t *uart{};
+	// single producer (isr) single consumer ring buffer, the indices run freely and are masked on access
+	std::array<rx_byte, RX_BUFFER_SIZE> rx_bytes{};
+	std::atomic<uint32_t> rx_write{};
+	std::atomic<uint32_t> rx_read{};
+	uint32_t rx_overruns{}; // bytes dropped because the consumer did not keep up
+	// frame notification, the notify_task is woken up when the frame_len-th byte after a frame_start byte arrived
+	TaskHandle_t notify_task{};
+	std::atomic<int> frame_len{};
+	char frame_start{};
+	int rx_frame_pos{};
+	// interrupt driven transmission, the frame in tx_bytes is sent by the tx interrupt once tx_started is set
+	// and is idle if tx_pos reached tx_len
+	std::array<char, 16> tx_bytes{};
+	std::array<uint64_t, 16> tx_times{}; // time_us_64() when each byte was handed to the uart
+	int tx_len{};
+	std::atomic<int> tx_pos{};
+	std::atomic<bool> tx_started{};
+	uint64_t tx_time{}; // scheduled time of the frame
+	bool tx_traced{true};
+	jitter_histogram tx_jitter{}; // deviation of the frame starts from their scheduled time, filled by both puts variants
+	uart_trace<> trace{};
 
 	uart_connection() {
 		uart = UART_ID == 0 ? uart0: uart1; 
@@ -19,13 +119,118 @@ struct uart_connection {
 		gpio_set_function(RX, UART_FUNCSEL_NUM(uart, RX));
 		gpio_set_function(TX, UART_FUNCSEL_NUM(uart, TX));
 		uart_set_format(uart, DATA_BITS, STOP_BITS, PARITY);
+		// without fifo the interrupt fires for every byte, with fifo the rx timeout would delay (and blur the timestamps) by 32 bit times.
+		// The pl011 can not raise the rx interrupt below 4 bytes in the fifo, so tx is interrupt driven instead to not busy wait per byte
+		uart_set_fifo_enabled(uart, false);
+		int irq = UART_ID == 0 ? UART0_IRQ: UART1_IRQ;
+		irq_set_exclusive_handler(irq, on_irq);
+		irq_set_enabled(irq, true);
+		uart_set_irq_enables(uart, true, false);
+	}
+
+	/** @brief sends the bytes from the tx interrupt, returns right away. Waits for the previous frame to be handed to the uart completely */
+	void puts(std::string_view bytes) {
+		_tx_prepare(time_us_64(), bytes);
+		_tx_start();
+	}
+	void puts(std::span<uint8_t> bytes) { puts(std::string_view{reinterpret_cast<const char*>(bytes.data()), bytes.size()}); }
+	/** @brief sends the bytes at time (time_us_64()) from the alarm and tx interrupts, returns right after the alarm is armed.
+	  * Waits for the previous frame to be handed to the uart completely */
+	void puts_at(uint64_t time, std::string_view bytes) {
+		_tx_prepare(time, bytes);
+		if (add_alarm_at(from_us_since_boot(time), on_tx_alarm, nullptr, true) < 0) {
+			LogError("No free alarm, sending frame directly");
+			_tx_start();
+		}
+	}
+	bool tx_idle() const { return tx_pos.load(std::memory_order_acquire) >= tx_len; }
+
+	/** @brief takes the oldest recieved byte out of the rx buffer, returns false if empty */
+	bool pop(rx_byte &b) {
+		_trace_tx();
+		uint32_t read = rx_read.load(std::memory_order_relaxed);
+		if (read == rx_write.load(std::memory_order_acquire))
+			return false;
+		b = rx_bytes[read % RX_BUFFER_SIZE];
+		rx_read.store(read + 1, std::memory_order_release);
+		trace.record(b.time, b.data, false);
+		return true;
+	}
+	/** @brief arms the notification of the calling task for the next frame starting with start and being len bytes long.
+	  * len = 0 disables the notification. Clears notifications still pending from earlier frames */
+	void expect_frame(char start, int len) {
+		notify_task = xTaskGetCurrentTaskHandle();
+		frame_len = 0;
+		frame_start = start;
+		xTaskNotifyStateClear(notify_task);
+		frame_len = len;
 	}
 
-	void putc(char c) { uart_putc(uart, c); }
-	void puts(std::span<uint8_t> bytes) { for (uint8_t b: bytes) uart_putc(uart, b); }
-	void puts(std::string_view bytes) { for (char b: bytes) uart_putc(uart, b); }
-	char getc() { return uart_getc(uart); }
+	/*INTERNAL*/ void _tx_prepare(uint64_t time, std::string_view bytes) {
+		while (!tx_idle())
+			vTaskDelay(1);
+		_trace_tx();
+		tx_started = false;
+		tx_len = std::min(bytes.size(), tx_bytes.size());
+		std::copy_n(bytes.begin(), tx_len, tx_bytes.begin());
+		tx_time = time;
+		tx_traced = false;
+		tx_pos = 0;
+	}
+	/** @brief the uart raises the tx interrupt as soon as it is enabled and the uart can take a byte,
+	  * so all bytes are written by on_irq() and never concurrently from the alarm or a task */
+	/*INTERNAL*/ void _tx_start() {
+		tx_started.store(true, std::memory_order_release);
+		uart_set_irq_enables(uart, true, true);
+	}
+	/*INTERNAL*/ void _trace_tx() {
+		if (tx_traced || !tx_idle())
+			return;
+		for (int i = 0; i < tx_len; ++i)
+			trace.record(tx_times[i], tx_bytes[i], true);
+		tx_traced = true;
+	}
+	/*INTERNAL*/ void _tx_next() {
+		int pos = tx_pos.load(std::memory_order_relaxed);
+		tx_times[pos] = time_us_64();
+		uart_putc_raw(uart, tx_bytes[pos]);
+		tx_pos.store(pos + 1, std::memory_order_release);
+	}
+
+	static int64_t on_tx_alarm(alarm_id_t, void *) {
+		uart_connection &u = Default();
+		u.tx_jitter.add(int64_t(time_us_64() - u.tx_time));
+		u._tx_start();
+		return 0;
+	}
+
+	static void on_irq() {
+		uart_connection &u = Default();
+		if (u.tx_started.load(std::memory_order_acquire)) {
+			while (!u.tx_idle() && uart_is_writable(u.uart))
+				u._tx_next();
+			if (u.tx_idle()) {
+				u.tx_started = false;
+				uart_set_irq_enables(u.uart, true, false);
+			}
+		}
+		BaseType_t woken{pdFALSE};
+		while (uart_is_readable(u.uart)) {
+			rx_byte b{.time = time_us_64(), .data = char(uart_get_hw(u.uart)->dr)};
+			uint32_t write = u.rx_write.load(std::memory_order_relaxed);
+			if (write - u.rx_read.load(std::memory_order_acquire) < RX_BUFFER_SIZE) {
+				u.rx_bytes[write % RX_BUFFER_SIZE] = b;
+				u.rx_write.store(write + 1, std::memory_order_release);
+			} else
+				++u.rx_overruns;
+			u.rx_frame_pos = b.data == u.frame_start ? 0: u.rx_frame_pos + 1;
+			int len = u.frame_len;
+			if (len && u.rx_frame_pos == len - 1 && u.notify_task)
+				vTaskNotifyGiveFromISR(u.notify_task, &woken);
+		}
+		portYIELD_FROM_ISR(woken);
+	}
 };
 
 using uart_futterstationen = uart_connection<17, 16, 0, 1200>;
-
+using uart_futterstationen_1 = uart_connection<5, 4, 1, 1200>; // second bus, only used if station_timing::buses is 2
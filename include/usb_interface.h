@@ -8,6 +8,9 @@
 #include "wifi_storage.h"
 #include "access_point.h"
 #include "kuhspeicher.h"
+#include "persistent_storage.h"
+#include "kraftfutterstation.h"
+#include "webserver.h"
 
 // handle exactly one command from the input stream at a time (should be called in an endless loop)
 static constexpr inline void handle_usb_command(std::istream &in = std::cin, std::ostream &out = std::cout) {
@@ -45,6 +48,17 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		out << "      reset_times\n";
 		out << "      reset_offsets\n";
 		out << "      rations\n\n";
+		out << "  set_timing ${variable} ${value}\n";
+		out << "    Set the station bus timing and store it. Available variables are:\n";
+		out << "      pipelined (1 ends frames early, 0 waits the full timeout of every frame)\n";
+		out << "      frame_timeouts_us (5 values for p0 p1 p2 feed p3, 1000 to 200000)\n";
+		out << "      frame_gap_us\n";
+		out << "      buses (1 or 2 uarts with stations, applied after a reboot)\n";
+		out << "      feeds_per_slot (rations given to a cow in a row before polling the next station)\n";
+		out << "      hw_timer (1 starts frames from a hardware alarm, 0 from the bus task)\n\n";
+		out << "  trace (start|stop|dump) ${bus}\n";
+		out << "    Record the bytes on a station bus with their time (one shot, stops when full) and print them\n";
+		out << "    as lines of 'time_us rx|tx hex'\n\n";
 		out << "  enable_wifi\n";
 		out << "    Activate wifi on the device\n\n";
 		out << "  disable_wifi\n";
@@ -78,6 +92,21 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		out << "settings:\n";
 		out << "-------------\n";
 		out << settings::Default();
+		out << "station timing:\n";
+		out << "-------------\n";
+		out << station_timing::Default();
+		out << "station bus:\n";
+		out << "-------------\n";
+		futterstationen_bus_0::Default().print_bus_stats(out);
+		if (futterstationen_bus_1::Default().started)
+			futterstationen_bus_1::Default().print_bus_stats(out);
+		out << "flash writes:\n";
+		out << "-------------\n";
+		out << persistent_storage_t::Default().stats;
+		out << "webserver:\n";
+		out << "-------------\n";
+		const auto &c = Webserver().conn_stats;
+		out << "connections opened " << c.opened << ", reused " << c.reused << " times, timed out " << c.timed_out << ", evicted " << c.evicted << '\n';
 		out << "wifi:\n";
 		out << "-------------\n";
 		out << wifi_storage::Default();
@@ -87,6 +116,32 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		if (!in)
 			out << "Error at setting the value\n";
 		in.clear();
+	} else if (command == "set_timing") {
+		in >> station_timing::Default(); // sets fail bit on error
+		if (in)
+			store_station_timing();
+		else
+			out << "Error at setting the value\n";
+		in.clear();
+	} else if (command == "trace") {
+		std::string action;
+		int bus{};
+		in >> action >> bus;
+		if (bus != 0 && (bus != 1 || !futterstationen_bus_1::Default().started)) {
+			out << "[ERROR] bus " << bus << " is not active\n";
+			return;
+		}
+		auto &trace = bus == 1 ? uart_futterstationen_1::Default().trace: uart_futterstationen::Default().trace;
+		if (action == "start")
+			trace.start();
+		else if (action == "stop")
+			trace.stop();
+		else if (action == "dump") {
+			out << "trace bus " << bus << ", " << trace.entries.size() << " bytes" << (trace.active ? ", recording": "") << '\n';
+			for (const auto &e: trace.entries)
+				out << static_format<32>("{} {} {:02x}\n", e.time, e.tx ? "tx": "rx", uint8_t(e.data));
+		} else
+			out << "[ERROR] trace action " << action << " not allowed. Allowed values are: start|stop|dump\n";
 	} else if (command == "enable_wifi") {
 		cyw43_arch_enable_sta_mode();
 	} else if (command == "disable_wifi") {
@@ -12,18 +12,36 @@
 #include "ntp_client.h"
 #include "settings.h"
 #include "kuhspeicher.h"
+#include "kraftfutterstation.h"
 
-using tcp_server_typed = tcp_server<18, 6, 5, 1>;
+using tcp_server_typed = tcp_server<22, 6, 7, 1>;
 
 tcp_server_typed& Webserver() {
 	// default endpoints from upstream
-	const auto static_page_callback = [] (std::string_view page, std::string_view status, std::string_view type = "text/html") {
-		return [page, status, type](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res){
-			res.res_set_status_line(HTTP_VERSION, status);
+	// static pages are served precompressed if the client accepts gzip, the ETag is the content hash from bin2h
+	const auto static_page_callback = [] (const web_asset &page, std::string_view status, std::string_view type = "text/html") {
+		return [&page, status, type](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res){
+			bool gzip = page.gzip.size() && req.headers_view.get_header("Accept-Encoding").find("gzip") != std::string_view::npos;
+			std::string_view body = gzip ? page.gzip: page.data;
+			static_string<32> etag{};
+			etag.fill_formatted(R"("{}{}")", page.hash, gzip ? "-gz": "");
+			bool not_modified = status == STATUS_OK && req.headers_view.get_header("If-None-Match").find(etag.sv()) != std::string_view::npos;
+			res.res_set_status_line(HTTP_VERSION, not_modified ? STATUS_NOT_MODIFIED: status);
 			res.res_add_header("Server", DEFAULT_SERVER);
 			res.res_add_header("Content-Type", type);
-			res.res_add_header("Content-Length", static_format<8>("{}", page.size()));
-			res.res_write_body(page);
+			if (gzip)
+				res.res_add_header("Content-Encoding", "gzip");
+			if (page.gzip.size())
+				res.res_add_header("Vary", "Accept-Encoding");
+			if (status == STATUS_OK) {
+				res.res_add_header("ETag", etag.sv());
+				res.res_add_header("Cache-Control", "no-cache");
+			}
+			res.res_add_header("Content-Length", static_format<8>("{}", body.size()));
+			if (not_modified)
+				res.res_write_body();
+			else
+				res.res_write_static_body(body);
 		};
 	};
 	const auto fill_unauthorized = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
@@ -203,7 +221,7 @@ tcp_server_typed& Webserver() {
 
 	// custom enpoints for kraftfutter application
 	const auto get_cow_names = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
-		constexpr int MAX_COWS_PER_RES{(tcp_server_typed::message_buffer{}.buffer.size() - 256) / kuh{}.name.storage.size()};
+		constexpr int MAX_COWS_PER_RES{(tcp_server_typed::buffer_size - 256) / int(kuh{}.name.storage.size())};
 		std::string_view auth_header = req.headers_view.get_header("Authorization");
 		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
 			fill_unauthorized(req, res);
@@ -221,9 +239,10 @@ tcp_server_typed& Webserver() {
 		res.res_write_body("{");
 		res.buffer.append_formatted(R"("cows_size":{},"cow_names":[)", cows.size());
 		cows = cows.subspan(offset, std::min<int>(cows.size() - offset, MAX_COWS_PER_RES));
-		for (const auto &cow: cows) {
-			if (&cow != cows.data())
+		for (uint32_t i = 0; i < cows.size(); ++i) {
+			if (i != 0)
 				res.buffer.append(',');
+			kuh cow = cows[i];
 			res.buffer.append_formatted(R"("{:5}: {}")", cow.knr, cow.name.sv());
 		}
 		res.res_write_body("]}");
@@ -239,15 +258,8 @@ tcp_server_typed& Webserver() {
 		}
 
 		std::string_view req_cow = req.path.substr(req.path.find_last_of('/') + 1);
-		const kuh *cow{};
-		for (const auto& c: kuhspeicher::Default().cows_view()) {
-			if (c.name.sv() == req_cow) {
-				cow = &c;
-				break;
-			}
-		}
-		
-		if (!cow) {
+		int cow_idx = kuhspeicher::Default().find_cow_by_name(req_cow);
+		if (cow_idx < 0) {
 			res.res_set_status_line(HTTP_VERSION, STATUS_BAD_REQUEST);
 			res.res_add_header("Server", DEFAULT_SERVER);
 			res.res_add_header("Content-Length", "0");
@@ -260,19 +272,7 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Type", CONTENT_JSON);
 		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
 		res.res_write_body();
-		int content_length = res.buffer.append_formatted(
-			R"({{"name":"{}","knr":{},"halsbandnr":{},"kraftfuttermenge":{},"abkalbungstag":{},"letzte_fuetterungen":[)", 
-			cow->name.sv(), cow->knr, cow->halsbandnr, cow->kraftfuttermenge, cow->abkalbungstag
-		);
-		for (const auto &feed_entry: cow->letzte_fuetterungen) {
-			if (&feed_entry != &cow->letzte_fuetterungen[0]) {
-				res.buffer.append(',');
-				++content_length;
-			}
-			content_length += res.buffer.append_formatted(R"("{}:{}")", feed_entry.station, feed_entry.timestamp);
-		};
-		res.buffer.append("]}");
-		content_length += 2;
+		int content_length = kuhspeicher::Default().print_cow_json(kuhspeicher::Default().cows_view()[cow_idx], res.buffer);
 		if (0 == format_to_sv(length_hdr, "{}", content_length))
 			LogError("Failed to write header length");
 	};
@@ -286,12 +286,13 @@ tcp_server_typed& Webserver() {
 		// parsing data of the type: {'name':'a_name',}
 		std::string_view status{STATUS_OK};
 		kuh* cow = kuhspeicher::Default().parse_cow_from_json(req.body);
+		int cow_idx;
 		if (!cow)
 			goto failure;
-		for (const auto& c: kuhspeicher::Default().cows_view())
-			if (cow->name.sv() == c.name.sv())
-				cow->letzte_fuetterungen = c.letzte_fuetterungen;
-		if (!kuhspeicher::Default().write_or_create_cow(*cow))
+		cow_idx = kuhspeicher::Default().find_cow_by_name(cow->name.sv());
+		if (cow_idx >= 0)
+			cow->letzte_fuetterungen = kuhspeicher::Default().cows_view()[cow_idx].letzte_fuetterungen;
+		if (!kuhspeicher::Default().write_or_create_cow(*cow, cow_idx))
 			goto failure;
 			
 		if (false) {
@@ -303,6 +304,75 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
+	const auto get_herd = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		std::string_view auth_header = req.headers_view.get_header("Authorization");
+		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+			fill_unauthorized(req, res);
+			return;
+		}
+
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Type", CONTENT_NDJSON);
+		res.res_add_header("Transfer-Encoding", "chunked");
+		res.res_write_body();
+		// one chunk per cow line, produced whenever the client can take more data
+		res.stream_cb = [cow_idx = 0](tcp_server_typed::message_buffer &res) mutable {
+			auto cows = kuhspeicher::Default().cows_view();
+			if (cow_idx >= int(cows.size())) {
+				res.buffer.append("0\r\n\r\n");
+				return false;
+			}
+			int s = res.buffer.size();
+			res.buffer.append("0000\r\n"); // chunk size is filled in after the cow was written
+			int chunk_size = kuhspeicher::Default().print_cow_json(cows[cow_idx++], res.buffer) + 1;
+			res.buffer.append("\n\r\n");
+			if (0 == format_to_sv(std::string_view{res.buffer.data() + s, 4}, "{:04x}", chunk_size))
+				LogError("Failed to write chunk size");
+			return true;
+		};
+	};
+	// called for every recieved part of the body, the response is sent after the last part
+	const auto put_herd = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		auto &speicher = kuhspeicher::Default();
+		if (!res.buffer.empty()) // request already answered (unauthorized or import not started), drop the rest of the body
+			return;
+		if (req.stream_aborted) { // client gone, nothing is answered
+			speicher.import_abort();
+			return;
+		}
+		if (!req.method.empty()) { // first part with the request line and headers
+			std::string_view auth_header = req.headers_view.get_header("Authorization");
+			if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+				fill_unauthorized(req, res);
+				return;
+			}
+			if (import_start started = speicher.import_begin(); started != import_start::STARTED) {
+				// a busy storage compacts its journal in the maintenance task meanwhile instead of blocking lwIP
+				const bool busy = started == import_start::STORAGE_BUSY;
+				res.res_set_status_line(HTTP_VERSION, busy ? STATUS_SERVICE_UNAVAILABLE: STATUS_BAD_REQUEST);
+				res.res_add_header("Server", DEFAULT_SERVER);
+				if (busy)
+					res.res_add_header("Retry-After", "1");
+				res.res_add_header("Content-Length", "0");
+				res.res_write_body();
+				return;
+			}
+		}
+		speicher.import_chunk(req.body);
+		if (req.body_remaining)
+			return;
+
+		bool success = speicher.import_end();
+		res.res_set_status_line(HTTP_VERSION, success ? STATUS_OK: STATUS_INTERNAL_SERVER_ERROR);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Type", CONTENT_JSON);
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body();
+		int content_length = res.buffer.append_formatted(R"({{"imported":{},"failed":{}}})", speicher.import_count, speicher.import_errors);
+		if (0 == format_to_sv(length_hdr, "{}", content_length))
+			LogError("Failed to write header length");
+	};
 	const auto delete_cow = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		std::string_view auth_header = req.headers_view.get_header("Authorization");
 		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
@@ -379,6 +449,78 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
+	const auto get_station_timing = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		std::string_view auth_header = req.headers_view.get_header("Authorization");
+		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+			fill_unauthorized(req, res);
+			return;
+		}
+		
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Type", CONTENT_JSON);
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body();
+		int content_length = station_timing::Default().dump_to_json(res.buffer);
+		if (0 == format_to_sv(length_hdr, "{}", content_length))
+			LogError("Failed to write header length");
+	};
+	const auto set_station_timing = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		std::string_view auth_header = req.headers_view.get_header("Authorization");
+		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+			fill_unauthorized(req, res);
+			return;
+		}
+
+		station_timing::Default().parse_from_json(req.body);
+		station_timing::Default().sanitize();
+		store_station_timing();
+		
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Length", "0");
+		res.res_write_body();
+	};
+	const auto get_station_stats = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		std::string_view auth_header = req.headers_view.get_header("Authorization");
+		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+			fill_unauthorized(req, res);
+			return;
+		}
+
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Type", CONTENT_JSON);
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body();
+		int content_length = res.buffer.append_formatted("[");
+		content_length += futterstationen_bus_0::Default().dump_bus_stats_json(res.buffer);
+		if (futterstationen_bus_1::Default().started)
+			content_length += futterstationen_bus_1::Default().dump_bus_stats_json(res.buffer, false);
+		content_length += res.buffer.append_formatted("]");
+		if (0 == format_to_sv(length_hdr, "{}", content_length))
+			LogError("Failed to write header length");
+	};
+	const auto get_station_jitter = [&fill_unauthorized](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		std::string_view auth_header = req.headers_view.get_header("Authorization");
+		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
+			fill_unauthorized(req, res);
+			return;
+		}
+
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", DEFAULT_SERVER);
+		res.res_add_header("Content-Type", CONTENT_JSON);
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body();
+		int content_length = res.buffer.append_formatted("[");
+		content_length += futterstationen_bus_0::Default().dump_jitter_json(res.buffer);
+		if (futterstationen_bus_1::Default().started)
+			content_length += futterstationen_bus_1::Default().dump_jitter_json(res.buffer, false);
+		content_length += res.buffer.append_formatted("]");
+		if (0 == format_to_sv(length_hdr, "{}", content_length))
+			LogError("Failed to write header length");
+	};
 	const auto last_feeds = [](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", DEFAULT_SERVER);
@@ -394,7 +536,7 @@ tcp_server_typed& Webserver() {
 		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
 		int content_length{2}; // outer square brackets of json array
 		res.res_write_body("[");
-		std::span<kuh> cows = kuhspeicher::Default().cows_view();
+		auto cows = kuhspeicher::Default().cows_view();
 		for (const auto &[cow, problem]: kuhspeicher::Default().problematic_cows) {
 			if (content_length != 2) {
 				res.res_write_body(",");
@@ -409,12 +551,16 @@ tcp_server_typed& Webserver() {
 
 	static tcp_server_typed webserver{
 		.port = 80,
-		.default_endpoint_cb = static_page_callback(_404_HTML, STATUS_NOT_FOUND),
+		.default_endpoint_cb = static_page_callback(_404_HTML_ASSET, STATUS_NOT_FOUND),
 		.get_endpoints = {
 			// kraftfutter-specific code
 			tcp_server_typed::endpoint{{.path_match = true}, "/cow_names", get_cow_names},
 			tcp_server_typed::endpoint{{.path_match = false}, "/cow_entry/", get_cow},
+			tcp_server_typed::endpoint{{.path_match = true}, "/herd", get_herd},
 			tcp_server_typed::endpoint{{.path_match = true}, "/setting", get_settings},
+			tcp_server_typed::endpoint{{.path_match = true}, "/station_timing", get_station_timing},
+			tcp_server_typed::endpoint{{.path_match = true}, "/station_stats", get_station_stats},
+			tcp_server_typed::endpoint{{.path_match = true}, "/station_jitter", get_station_jitter},
 			// interactive endpoints
 			tcp_server_typed::endpoint{{.path_match = true}, "/logs", get_logs},
 			tcp_server_typed::endpoint{{.path_match = true}, "/discovered_wifis", get_discovered_wifis},
@@ -427,13 +573,13 @@ tcp_server_typed& Webserver() {
 			// time endpoint
 			tcp_server_typed::endpoint{{.path_match = true}, "/time", get_time},
 			// static file serve endpoints
-			tcp_server_typed::endpoint{{.path_match = true}, "/", static_page_callback(INDEX_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/index.html", static_page_callback(INDEX_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/style.css", static_page_callback(STYLE_CSS, STATUS_OK, "text/css")},
-			tcp_server_typed::endpoint{{.path_match = true}, "/internet.html", static_page_callback(INTERNET_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/overview.html", static_page_callback(OVERVIEW_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/settings.html", static_page_callback(SETTINGS_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/cow.svg", static_page_callback(COW_SVG, STATUS_OK, "image/svg+xml")},
+			tcp_server_typed::endpoint{{.path_match = true}, "/", static_page_callback(INDEX_HTML_ASSET, STATUS_OK)},
+			tcp_server_typed::endpoint{{.path_match = true}, "/index.html", static_page_callback(INDEX_HTML_ASSET, STATUS_OK)},
+			tcp_server_typed::endpoint{{.path_match = true}, "/style.css", static_page_callback(STYLE_CSS_ASSET, STATUS_OK, "text/css")},
+			tcp_server_typed::endpoint{{.path_match = true}, "/internet.html", static_page_callback(INTERNET_HTML_ASSET, STATUS_OK)},
+			tcp_server_typed::endpoint{{.path_match = true}, "/overview.html", static_page_callback(OVERVIEW_HTML_ASSET, STATUS_OK)},
+			tcp_server_typed::endpoint{{.path_match = true}, "/settings.html", static_page_callback(SETTINGS_HTML_ASSET, STATUS_OK)},
+			tcp_server_typed::endpoint{{.path_match = true}, "/cow.svg", static_page_callback(COW_SVG_ASSET, STATUS_OK, "image/svg+xml")},
 		},
 		.post_endpoints = {
 			tcp_server_typed::endpoint{{.path_match = true}, "/set_log_level", set_log_level},
@@ -448,7 +594,9 @@ tcp_server_typed& Webserver() {
 			tcp_server_typed::endpoint{{.path_match = true}, "/time", set_time},
 			tcp_server_typed::endpoint{{.path_match = true}, "/cow_entry", put_cow},
 			tcp_server_typed::endpoint{{.path_match = true}, "/setting", set_settings},
+			tcp_server_typed::endpoint{{.path_match = true}, "/station_timing", set_station_timing},
 			tcp_server_typed::endpoint{{.path_match = true}, "/kraftfutter", put_kraftfutter},
+			tcp_server_typed::endpoint{{.path_match = true, .stream_body = true}, "/herd", put_herd},
 		},
 		.delete_endpoints = {
 			tcp_server_typed::endpoint{{.path_match = true}, "/cow_entry", delete_cow},
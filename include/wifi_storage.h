@@ -87,6 +87,8 @@ struct wifi_storage {
 	void check_set_reboot() {
 		if (request_reboot) {
 			LogInfo("Rebooting...");
+			if (PICO_OK != persistent_storage_t::Default().flush())
+				LogError("Failed to flush storage before reboot");
 			watchdog_enable(1, 1);
 			// (*((volatile uint32_t*)(PPB_BASE + 0x0ED0C))) = 0x5FA0004;
 		}
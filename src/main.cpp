@@ -34,32 +34,40 @@ void usb_comm_task(void *) {
     }
 }
 
-void recieve_task(void *) {
-    LogInfo("starting recieve task");
-    kraftfutterstation<>::Default().receive_packages();
-}
-
+template<typename bus>
 void kraftfutter_send_task(void *) {
-    LogInfo("Starting kraftfutter communcation task");
+    LogInfo("Starting kraftfutter communcation task for stations {} to {}", bus::station_offset, bus::station_offset + bus::stations - 1);
+    bus::Default().started = true;
     for (;;) {
         watchdog_update();
-        int delay = kraftfutterstation<>::Default().handle_station_communication();
+        int delay = bus::Default().handle_station_communication();
+        // woken up early by the uart rx interrupt if the awaited answer is complete
         if (delay)
-            vTaskDelay(delay);
+            ulTaskNotifyTake(pdTRUE, delay);
     }
 }
 
 void check_problematic_cows_task(void *) {
     LogInfo("Starting p1oblematic cows task");
+    kuhspeicher::Default().problematic_cows_task = xTaskGetCurrentTaskHandle();
     for (;;) {
-        LogInfo("Updating problematic cows");
         // if not yet time synchronized rerun earlier
         if (ntp_client::Default().ntp_time == 0) {
             vTaskDelay(1000);
             continue;
         }
-        kuhspeicher::Default().check_for_problematic_cows();
-        vTaskDelay(5000);
+        LogInfo("Updating problematic cows");
+        int wait_ms = kuhspeicher::Default().check_for_problematic_cows();
+        // woken up early by a notification if a cow changed
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(std::max(wait_ms, 1)));
+    }
+}
+
+void storage_maintenance_task(void *) {
+    LogInfo("Starting storage maintenance task");
+    for (;;) {
+        persistent_storage_t::Default().maintain();
+        vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
 
@@ -107,6 +115,7 @@ void startup_task(void *) {
     Webserver().start();
     LogInfo("Ready, running http at {}", ip4addr_ntoa(netif_ip4_addr(netif_list)));
     LogInfo("Loaded cow storage with {} cows", kuhspeicher::Default().cows_size());
+    kuhspeicher::Default().migrate_storage();
     LogInfo("Sanitizing cows...");
     kuhspeicher::Default().sanitize_cows();
     LogInfo("Sanitizing cows done");
@@ -114,37 +123,49 @@ void startup_task(void *) {
     persistent_storage_t::Default().read(&persistent_storage_layout::setting, settings::Default());
     if (settings::Default().sanitize())
         persistent_storage_t::Default().write(settings::Default(), &persistent_storage_layout::setting);
+    load_station_timing();
     LogInfo("Loading settings done");
     LogInfo("Loading last feeds");
+    uint64_t reload_start = time_us_64();
     kuhspeicher::Default().reload_last_feeds();
-    LogInfo("Loading last feeds done");
+    measurements::Default().reload_last_feeds_us = uint32_t(time_us_64() - reload_start);
+    measurements::Default().reload_last_feeds_cows = kuhspeicher::Default().cows_size();
+    LogInfo("Loading last feeds done in {} us", measurements::Default().reload_last_feeds_us);
     LogInfo("Initialization done");
     // singleton initiliazations...
+    rations_in_flight<>::Default().load();
     uart_futterstationen::Default();
-    kraftfutterstation<>::Default();
+    futterstationen_bus_0::Default();
     static_format<128>("");
     static_format<8>("");
     std::cout << "Initialization done, get all further info via the commands shown in 'help'\n";
     cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
     TaskHandle_t task_usb_comm{};
     TaskHandle_t task_update_wifi{};
-    TaskHandle_t task_recieve{};
     TaskHandle_t task_problematic_cows{};
+    TaskHandle_t task_storage_maintenance{};
+    TaskHandle_t task_bus_1{};
     auto err = xTaskCreate(usb_comm_task, "usb_comm", 512, NULL, 0, &task_usb_comm);	// usb task also has to be started only after cyw43 init as some wifi functions are available
     if (err != pdPASS)
         LogError("Failed to start usb communication task with code {}" ,err);
     err = xTaskCreate(wifi_search_task, "UpdateWifiThread", 512, NULL, 0, &task_update_wifi);
     if (err != pdPASS)
         LogError("Failed to start usb communication task with code {}" ,err);
-    err = xTaskCreate(recieve_task, "UartRecTask", 512, NULL, 0, &task_recieve);
-    if (err != pdPASS)
-        LogError("Failed to start uart recieve task 1 with code {}" ,err);
     err = xTaskCreate(check_problematic_cows_task, "ProbCows", 512, NULL, 0, &task_problematic_cows);
     if (err != pdPASS)
         LogError("Failed to start problematic cows task with code {}" ,err);
+    err = xTaskCreate(storage_maintenance_task, "StorageMaint", 512, NULL, 0, &task_storage_maintenance);
+    if (err != pdPASS)
+        LogError("Failed to start storage maintenance task with code {}" ,err);
+    if (station_timing::Default().buses > 1) {
+        uart_futterstationen_1::Default();
+        err = xTaskCreate(kraftfutter_send_task<futterstationen_bus_1>, "StationBus1", 512, NULL, 0, &task_bus_1);
+        if (err != pdPASS)
+            LogError("Failed to start station bus 1 task with code {}" ,err);
+    }
 
     cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
-    kraftfutter_send_task(nullptr);
+    kraftfutter_send_task<futterstationen_bus_0>(nullptr);
 }
 
 int main( void )